@@ -0,0 +1,530 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <sched.h>
+#include <time.h>
+#include <malloc.h>
+
+#include "arena.h"
+
+// Benchmark for the arena allocator (mymalloc/myfree) against glibc malloc.
+//
+//   ./allocbench [-w mixed|prodcons|freelat] [-t threads] [-n ops] [-a arena|glibc]
+//   ./allocbench -r trace.txt [-a arena|glibc]
+//
+// Synthetic workloads report throughput, p50/p99 latency per call and the
+// footprint (bytes held from the OS) against the live bytes requested. -r
+// replays a trace recorded by running the server with ARENA_TRACE=path.
+
+#define DEFAULT_THREADS 4
+#define DEFAULT_OPS 1000000
+#define LIVE_SLOTS 1024     // Live blocks per thread in the mixed workload
+#define HANDOFF_SIZE 1024   // Producer/consumer ring size (power of two)
+#define FREED_SENTINEL ((void *)1)
+
+typedef struct {
+    const char *name;
+    void *(*alloc)(size_t size);
+    void (*release)(void *ptr);
+} Allocator;
+
+static const Allocator allocators[] = {
+    {"arena", mymalloc, myfree},
+    {"glibc", malloc, free},
+};
+
+// Per-thread results
+typedef struct {
+    int id;
+    const Allocator *allocator;
+    long ops;
+    uint32_t *latency;  // Nanoseconds per timed call
+    long samples;
+    size_t live_bytes;  // Bytes still requested when the footprint is taken
+} Worker;
+
+static pthread_barrier_t measure_barrier; // Workers park here while the footprint is taken
+static pthread_barrier_t release_barrier;
+
+static uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static uint64_t next_random(uint64_t *state) {
+    *state ^= *state << 13;
+    *state ^= *state >> 7;
+    *state ^= *state << 17;
+    return *state;
+}
+
+// 70% small (16-256B), 25% medium (256B-4KB), 5% large (4-64KB)
+static size_t random_size(uint64_t *state) {
+    uint64_t r = next_random(state);
+    unsigned pick = r % 100;
+
+    if (pick < 70) return 16 + (r >> 8) % 241;
+    if (pick < 95) return 256 + (r >> 8) % 3841;
+    return 4096 + (r >> 8) % 61441;
+}
+
+static void record(Worker *worker, uint64_t start) {
+    uint64_t elapsed = now_ns() - start;
+    worker->latency[worker->samples++] = elapsed > UINT32_MAX ? UINT32_MAX : (uint32_t)elapsed;
+}
+
+// Bytes the allocator currently holds from the OS
+static size_t footprint(const Allocator *allocator) {
+    if (allocator->alloc == mymalloc) {
+        ArenaStats stats;
+        arena_get_stats(&stats);
+        return stats.mapped_bytes;
+    }
+    struct mallinfo2 info = mallinfo2();
+    return info.arena + info.hblkhd;
+}
+
+// Random alloc/free over a fixed set of slots per thread
+static void *mixed_worker(void *arg) {
+    Worker *worker = (Worker *)arg;
+    const Allocator *allocator = worker->allocator;
+    void *slots[LIVE_SLOTS] = {0};
+    size_t sizes[LIVE_SLOTS] = {0};
+    uint64_t state = 0x9E3779B97F4A7C15ULL * (worker->id + 1);
+
+    for (long op = 0; op < worker->ops; op++) {
+        int slot = next_random(&state) % LIVE_SLOTS;
+        uint64_t start = now_ns();
+        if (slots[slot]) {
+            allocator->release(slots[slot]);
+            record(worker, start);
+            worker->live_bytes -= sizes[slot];
+            slots[slot] = NULL;
+        } else {
+            size_t size = random_size(&state);
+            slots[slot] = allocator->alloc(size);
+            record(worker, start);
+            if (slots[slot]) {
+                *(char *)slots[slot] = 1;
+                sizes[slot] = size;
+                worker->live_bytes += size;
+            }
+        }
+    }
+
+    pthread_barrier_wait(&measure_barrier);
+    pthread_barrier_wait(&release_barrier);
+    for (int slot = 0; slot < LIVE_SLOTS; slot++) {
+        allocator->release(slots[slot]);
+    }
+    return NULL;
+}
+
+// Single-producer/single-consumer handoff between a pair of workers
+typedef struct {
+    _Atomic(void *) items[HANDOFF_SIZE];
+    _Atomic long head;
+    _Atomic long tail;
+} Handoff;
+
+typedef struct {
+    Worker worker;
+    Handoff *handoff;
+    int producer;
+} PairWorker;
+
+// Producers allocate, consumers free: every free is a remote free
+static void *prodcons_worker(void *arg) {
+    PairWorker *pair = (PairWorker *)arg;
+    Worker *worker = &pair->worker;
+    Handoff *handoff = pair->handoff;
+    uint64_t state = 0x9E3779B97F4A7C15ULL * (worker->id + 1);
+
+    for (long op = 0; op < worker->ops; op++) {
+        if (pair->producer) {
+            long tail = atomic_load_explicit(&handoff->tail, memory_order_relaxed);
+            while (tail - atomic_load_explicit(&handoff->head, memory_order_acquire) >= HANDOFF_SIZE) {
+                sched_yield();
+            }
+            uint64_t start = now_ns();
+            void *ptr = worker->allocator->alloc(random_size(&state));
+            record(worker, start);
+            if (ptr) *(char *)ptr = 1;
+            atomic_store_explicit(&handoff->items[tail % HANDOFF_SIZE], ptr, memory_order_relaxed);
+            atomic_store_explicit(&handoff->tail, tail + 1, memory_order_release);
+        } else {
+            long head = atomic_load_explicit(&handoff->head, memory_order_relaxed);
+            while (atomic_load_explicit(&handoff->tail, memory_order_acquire) == head) {
+                sched_yield();
+            }
+            void *ptr = atomic_load_explicit(&handoff->items[head % HANDOFF_SIZE], memory_order_relaxed);
+            atomic_store_explicit(&handoff->head, head + 1, memory_order_release);
+            uint64_t start = now_ns();
+            worker->allocator->release(ptr);
+            record(worker, start);
+        }
+    }
+
+    pthread_barrier_wait(&measure_barrier);
+    pthread_barrier_wait(&release_barrier);
+    return NULL;
+}
+
+static int compare_latency(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+    return (x > y) - (x < y);
+}
+
+// Print one result line. Live bytes and overhead are left out when nothing
+// was live as the footprint was taken. Returns the p50 latency.
+static uint32_t report(const char *workload, const Allocator *allocator, Worker *workers, int threads,
+                       double seconds, size_t used_footprint, size_t live_bytes) {
+    long samples = 0;
+    for (int i = 0; i < threads; i++) samples += workers[i].samples;
+
+    uint32_t *all = malloc(sizeof(uint32_t) * (samples ? samples : 1));
+    long n = 0;
+    for (int i = 0; i < threads; i++) {
+        memcpy(all + n, workers[i].latency, sizeof(uint32_t) * workers[i].samples);
+        n += workers[i].samples;
+    }
+    qsort(all, n, sizeof(uint32_t), compare_latency);
+
+    printf("%-10s %-6s threads=%-3d %8.2f Mops/s  p50=%6u ns  p99=%7u ns  footprint=%8.2f MB",
+           workload, allocator->name, threads, n / seconds / 1e6,
+           n ? all[n / 2] : 0, n ? all[(long)(n * 0.99)] : 0, used_footprint / 1048576.0);
+    if (live_bytes) {
+        printf("  live=%8.2f MB  overhead=%.2fx", live_bytes / 1048576.0, (double)used_footprint / live_bytes);
+    }
+    printf("\n");
+    uint32_t p50 = n ? all[n / 2] : 0;
+    free(all);
+    return p50;
+}
+
+static void run_synthetic(const char *workload, const Allocator *allocator, int threads, long ops) {
+    int prodcons = strcmp(workload, "prodcons") == 0;
+    if (prodcons && threads % 2) threads++; // Workers come in pairs
+
+    PairWorker *pairs = calloc(threads, sizeof(PairWorker));
+    Handoff *handoffs = calloc(threads / 2 + 1, sizeof(Handoff));
+    Worker *workers = calloc(threads, sizeof(Worker));
+    pthread_t *tids = calloc(threads, sizeof(pthread_t));
+
+    pthread_barrier_init(&measure_barrier, NULL, threads + 1);
+    pthread_barrier_init(&release_barrier, NULL, threads + 1);
+
+    uint64_t start = now_ns();
+    for (int i = 0; i < threads; i++) {
+        Worker *worker = &pairs[i].worker;
+        worker->id = i;
+        worker->allocator = allocator;
+        worker->ops = ops;
+        worker->latency = malloc(sizeof(uint32_t) * ops);
+        pairs[i].handoff = &handoffs[i / 2];
+        pairs[i].producer = i % 2 == 0;
+        pthread_create(&tids[i], NULL, prodcons ? prodcons_worker : mixed_worker, &pairs[i]);
+    }
+
+    // Prodcons consumers have freed every block by now, so it has no live
+    // bytes to weigh the footprint against: only what the allocator kept
+    pthread_barrier_wait(&measure_barrier);
+    double seconds = (now_ns() - start) / 1e9;
+    size_t used_footprint = footprint(allocator);
+    size_t live_bytes = 0;
+    for (int i = 0; i < threads; i++) {
+        workers[i] = pairs[i].worker;
+        live_bytes += workers[i].live_bytes;
+    }
+    pthread_barrier_wait(&release_barrier);
+
+    for (int i = 0; i < threads; i++) {
+        pthread_join(tids[i], NULL);
+    }
+    report(workload, allocator, workers, threads, seconds, used_footprint, live_bytes);
+
+    for (int i = 0; i < threads; i++) free(workers[i].latency);
+    pthread_barrier_destroy(&measure_barrier);
+    pthread_barrier_destroy(&release_barrier);
+    free(pairs);
+    free(handoffs);
+    free(workers);
+    free(tids);
+}
+
+// Stress test for constant-time coalescing: free latency as the number of
+// live blocks grows. Sizes stay above the thread cache limit so every free
+// goes through arena coalescing, in random order so neighbours are a mix of
+// free and allocated. The footprint is taken with every block live. A free
+// that scanned the block list would slow down with the heap; the last line
+// compares the p50 growth against the growth in live blocks.
+static void run_free_latency(const Allocator *allocator) {
+    static const int live_counts[] = {1000, 5000, 25000};
+    const int rounds = sizeof(live_counts) / sizeof(live_counts[0]);
+    uint32_t first_p50 = 0, last_p50 = 0;
+    uint64_t state = 42;
+
+    for (int i = 0; i < rounds; i++) {
+        int live = live_counts[i];
+        size_t live_bytes = 0;
+        void **blocks = malloc(sizeof(void *) * live);
+        for (int j = 0; j < live; j++) {
+            size_t size = CACHE_MAX_SIZE + 8 + next_random(&state) % 1024;
+            blocks[j] = allocator->alloc(size);
+            live_bytes += blocks[j] ? size : 0;
+        }
+        size_t used_footprint = footprint(allocator);
+        for (int j = live - 1; j > 0; j--) {
+            int k = next_random(&state) % (j + 1);
+            void *tmp = blocks[j];
+            blocks[j] = blocks[k];
+            blocks[k] = tmp;
+        }
+
+        Worker worker = {0};
+        worker.allocator = allocator;
+        worker.latency = malloc(sizeof(uint32_t) * live);
+        uint64_t start = now_ns();
+        for (int j = 0; j < live; j++) {
+            uint64_t call = now_ns();
+            allocator->release(blocks[j]);
+            record(&worker, call);
+        }
+
+        char label[32];
+        snprintf(label, sizeof(label), "free@%d", live);
+        last_p50 = report(label, allocator, &worker, 1, (now_ns() - start) / 1e9, used_footprint, live_bytes);
+        if (i == 0) {
+            first_p50 = last_p50;
+        }
+        free(worker.latency);
+        free(blocks);
+    }
+    printf("freelat    %-6s p50 x%.2f for x%d live blocks\n", allocator->name,
+           first_p50 ? (double)last_p50 / first_p50 : 0.0, live_counts[rounds - 1] / live_counts[0]);
+}
+
+// Trace replay: one thread per traced thread, each running its own calls in
+// recorded order. A free of a block allocated on another thread waits until
+// that allocation has been replayed.
+typedef struct {
+    char op;    // 'a' or 'f'
+    size_t size;
+    long slot;  // Allocation this call creates or frees
+} TraceOp;
+
+typedef struct {
+    Worker worker;
+    TraceOp *ops;
+    long count;
+    long capacity;
+} TraceThread;
+
+static _Atomic(void *) *trace_slots;
+static long trace_slot_count;
+
+// Open-addressed map from traced address to the slot of its latest allocation
+typedef struct {
+    uintptr_t *keys;
+    long *values;
+    long capacity;
+    long size;
+} AddressMap;
+
+static long *address_map_find(AddressMap *map, uintptr_t key, int insert) {
+    if (insert && map->size * 2 >= map->capacity) {
+        AddressMap grown = {calloc(map->capacity * 2, sizeof(uintptr_t)),
+                            calloc(map->capacity * 2, sizeof(long)), map->capacity * 2, 0};
+        for (long i = 0; i < map->capacity; i++) {
+            if (map->keys[i]) *address_map_find(&grown, map->keys[i], 1) = map->values[i];
+        }
+        free(map->keys);
+        free(map->values);
+        *map = grown;
+    }
+
+    long i = (long)((key >> 4) * 0x9E3779B97F4A7C15ULL % (uint64_t)map->capacity);
+    while (map->keys[i] && map->keys[i] != key) {
+        i = (i + 1) % map->capacity;
+    }
+    if (!map->keys[i]) {
+        if (!insert) return NULL;
+        map->keys[i] = key;
+        map->size++;
+    }
+    return &map->values[i];
+}
+
+static void *replay_worker(void *arg) {
+    TraceThread *thread = (TraceThread *)arg;
+    Worker *worker = &thread->worker;
+
+    for (long i = 0; i < thread->count; i++) {
+        TraceOp *op = &thread->ops[i];
+        if (op->op == 'a') {
+            uint64_t start = now_ns();
+            void *ptr = worker->allocator->alloc(op->size);
+            record(worker, start);
+            atomic_store_explicit(&trace_slots[op->slot], ptr ? ptr : FREED_SENTINEL, memory_order_release);
+        } else {
+            void *ptr;
+            while (!(ptr = atomic_load_explicit(&trace_slots[op->slot], memory_order_acquire))) {
+                sched_yield();
+            }
+            atomic_store_explicit(&trace_slots[op->slot], FREED_SENTINEL, memory_order_relaxed);
+            uint64_t start = now_ns();
+            if (ptr != FREED_SENTINEL) worker->allocator->release(ptr);
+            record(worker, start);
+        }
+    }
+    return NULL;
+}
+
+static TraceThread *load_trace(const char *path, int *thread_count) {
+    FILE *file = fopen(path, "r");
+    if (!file) {
+        perror("Could not open trace");
+        exit(EXIT_FAILURE);
+    }
+
+    TraceThread *threads = NULL;
+    int count = 0;
+    AddressMap map = {calloc(1024, sizeof(uintptr_t)), calloc(1024, sizeof(long)), 1024, 0};
+    char line[BUFSIZ];
+
+    while (fgets(line, sizeof(line), file)) {
+        char op;
+        int tid;
+        void *ptr;
+        size_t size = 0;
+        if (sscanf(line, "%c %d %p %zu", &op, &tid, &ptr, &size) < 3 || tid < 0) continue;
+
+        TraceOp call = {op, size, -1};
+        if (op == 'a') {
+            call.slot = trace_slot_count++;
+            *address_map_find(&map, (uintptr_t)ptr, 1) = call.slot;
+        } else {
+            long *slot = address_map_find(&map, (uintptr_t)ptr, 0);
+            if (!slot || *slot < 0) continue; // Allocated before the trace started
+            call.slot = *slot;
+            *slot = -1;
+        }
+
+        if (tid >= count) {
+            threads = realloc(threads, sizeof(TraceThread) * (tid + 1));
+            memset(threads + count, 0, sizeof(TraceThread) * (tid + 1 - count));
+            count = tid + 1;
+        }
+        TraceThread *thread = &threads[tid];
+        if (thread->count == thread->capacity) {
+            thread->capacity = thread->capacity ? thread->capacity * 2 : 1024;
+            thread->ops = realloc(thread->ops, sizeof(TraceOp) * thread->capacity);
+        }
+        thread->ops[thread->count++] = call;
+    }
+
+    fclose(file);
+    free(map.keys);
+    free(map.values);
+    *thread_count = count;
+    return threads;
+}
+
+static void run_replay(const char *path, const Allocator *allocator) {
+    int count;
+    TraceThread *threads = load_trace(path, &count);
+    trace_slots = calloc(trace_slot_count ? trace_slot_count : 1, sizeof(void *));
+
+    pthread_t *tids = calloc(count, sizeof(pthread_t));
+    uint64_t start = now_ns();
+    for (int i = 0; i < count; i++) {
+        threads[i].worker.allocator = allocator;
+        threads[i].worker.latency = malloc(sizeof(uint32_t) * (threads[i].count + 1));
+        pthread_create(&tids[i], NULL, replay_worker, &threads[i]);
+    }
+    for (int i = 0; i < count; i++) {
+        pthread_join(tids[i], NULL);
+    }
+    double seconds = (now_ns() - start) / 1e9;
+
+    // Blocks the trace never freed are still live here
+    size_t used_footprint = footprint(allocator);
+    Worker *workers = calloc(count ? count : 1, sizeof(Worker));
+    for (int i = 0; i < count; i++) {
+        workers[i] = threads[i].worker;
+        for (long j = 0; j < threads[i].count; j++) {
+            TraceOp *op = &threads[i].ops[j];
+            void *ptr = atomic_load(&trace_slots[op->slot]);
+            if (op->op == 'a' && ptr != FREED_SENTINEL) workers[i].live_bytes += op->size;
+        }
+    }
+    size_t live_bytes = 0;
+    for (int i = 0; i < count; i++) live_bytes += workers[i].live_bytes;
+    report("replay", allocator, workers, count, seconds, used_footprint, live_bytes);
+
+    for (long slot = 0; slot < trace_slot_count; slot++) {
+        void *ptr = atomic_load(&trace_slots[slot]);
+        if (ptr != FREED_SENTINEL) allocator->release(ptr);
+    }
+    for (int i = 0; i < count; i++) {
+        free(threads[i].ops);
+        free(threads[i].worker.latency);
+    }
+    free(threads);
+    free(workers);
+    free(tids);
+    free((void *)trace_slots);
+    trace_slot_count = 0;
+}
+
+int main(int argc, char *argv[]) {
+    const char *workload = "mixed";
+    const char *only = NULL;
+    const char *trace = NULL;
+    int threads = DEFAULT_THREADS;
+    long ops = DEFAULT_OPS;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "w:t:n:a:r:")) != -1) {
+        switch (opt) {
+        case 'w': workload = optarg; break;
+        case 't': threads = atoi(optarg); break;
+        case 'n': ops = atol(optarg); break;
+        case 'a': only = optarg; break;
+        case 'r': trace = optarg; break;
+        default:
+            fprintf(stderr, "Usage: %s [-w mixed|prodcons|freelat] [-t threads] [-n ops] [-a arena|glibc] [-r trace]\n", argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    if (threads < 1 || ops < 1) {
+        fprintf(stderr, "threads and ops must be positive\n");
+        return EXIT_FAILURE;
+    }
+
+    // Replaying with tracing on would rewrite the trace being read
+    unsetenv("ARENA_TRACE");
+    initialize_arena();
+
+    for (size_t i = 0; i < sizeof(allocators) / sizeof(allocators[0]); i++) {
+        const Allocator *allocator = &allocators[i];
+        if (only && strcmp(only, allocator->name) != 0) continue;
+
+        if (trace) {
+            run_replay(trace, allocator);
+        } else if (strcmp(workload, "freelat") == 0) {
+            run_free_latency(allocator);
+        } else if (strcmp(workload, "mixed") == 0 || strcmp(workload, "prodcons") == 0) {
+            run_synthetic(workload, allocator, threads, ops);
+        } else {
+            fprintf(stderr, "Unknown workload: %s\n", workload);
+            return EXIT_FAILURE;
+        }
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,795 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+
+#define ARENA_SIZE (10 * 1024 * 1024) // 10MB, size of each arena chunk
+#define ALIGNMENT 8 // Memory alignment
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024) // Chunk granularity in hugepage mode
+
+// Segregated free lists: four bins per power of two, sizes below 32 bytes
+// share the first four bins. Anything past the last class lands in the last bin.
+#define NUM_SIZE_CLASSES 128
+#define SUBCLASS_BITS 2
+#define SMALL_CLASS_LIMIT 32
+
+// Per-thread caches: power-of-two classes from 32 bytes to 4KB. Requests up to
+// CACHE_MAX_SIZE are served from the calling thread's magazine, which is
+// refilled from and flushed to the arena CACHE_BATCH blocks at a time.
+#define CACHE_CLASSES 8
+#define CACHE_MIN_SHIFT 5
+#define CACHE_MAX_SIZE (1 << (CACHE_MIN_SHIFT + CACHE_CLASSES - 1))
+#define MAGAZINE_SIZE 32
+#define CACHE_BATCH (MAGAZINE_SIZE / 2)
+
+struct ThreadCache;
+
+// Structure for managing memory blocks
+typedef struct MemoryBlock {
+    size_t size;                   // Size of the block
+    int is_free;                   // Is the block free?
+    int cache_class;               // Thread cache class, -1 for arena blocks
+    struct MemoryBlock *next;      // Pointer to the next block
+    struct MemoryBlock *prev;      // Pointer to the previous block
+    struct MemoryBlock *next_free; // Next free block in the same size class
+    struct MemoryBlock *prev_free; // Previous free block in the same size class
+    struct ThreadCache *owner;     // Cache that hands this block out, NULL for arena blocks
+} MemoryBlock;
+
+// Allocator counters, kept up to date as blocks move in and out of the bins
+#define ARENA_HISTOGRAM_BUCKETS 40
+
+typedef struct ArenaStats {
+    size_t mapped_bytes;       // Bytes mapped from the OS, headers included
+    size_t used_bytes;         // Bytes in allocated blocks (thread caches included)
+    size_t free_bytes;         // Bytes in free blocks
+    size_t used_blocks;        // Number of allocated blocks
+    size_t free_blocks;        // Number of free blocks
+    size_t largest_free_block; // Filled in by arena_get_stats
+    int chunks;                // Filled in by arena_get_stats
+    double fragmentation;      // 1 - largest_free_block / free_bytes, filled in by arena_get_stats
+    size_t used_histogram[ARENA_HISTOGRAM_BUCKETS]; // Allocated blocks by floor(log2(size))
+    size_t free_histogram[ARENA_HISTOGRAM_BUCKETS]; // Free blocks by floor(log2(size))
+} ArenaStats;
+
+// Header at the start of every mmap'd chunk. The chunk's blocks follow it;
+// the first block has prev == NULL and the last has next == NULL.
+typedef struct ArenaChunk {
+    size_t size;              // Bytes mapped, header included
+    int huge;                 // Mapped with MAP_HUGETLB
+    int trimmed;              // Pages handed back with MADV_DONTNEED while idle
+    struct ArenaChunk *next;  // Pointer to the next chunk
+    struct ArenaChunk *prev;  // Pointer to the previous chunk
+} ArenaChunk;
+
+#define CHUNK_HEADER_SIZE ((sizeof(ArenaChunk) + ALIGNMENT - 1) & ~(size_t)(ALIGNMENT - 1))
+
+// Thread-local magazine of ready-to-use blocks. Blocks freed by other threads
+// are pushed onto remote_free without a lock and drained by the owner.
+typedef struct ThreadCache {
+    MemoryBlock *blocks[CACHE_CLASSES][MAGAZINE_SIZE];
+    int count[CACHE_CLASSES];
+    _Atomic(MemoryBlock *) remote_free;
+    struct ThreadCache *next_idle; // Link in idle_caches once the owner thread exits
+} ThreadCache;
+
+static ArenaChunk *arena = NULL;                // Chunks making up the memory arena
+static int arena_chunks = 0;                    // Number of mapped chunks
+static int arena_hugepages = 0;                 // Back chunks with hugepages (ARENA_HUGEPAGES=1)
+static ArenaStats arena_stats;                  // Allocator counters, guarded by memory_mutex
+static FILE *arena_trace = NULL;                // ARENA_TRACE=path records every mymalloc/myfree
+static atomic_int arena_trace_threads;          // Thread ids handed out to the trace
+static __thread int arena_trace_tid = -1;       // Calling thread's id in the trace
+static MemoryBlock *bins[NUM_SIZE_CLASSES];     // Free lists, one per size class
+static uint64_t bin_map[NUM_SIZE_CLASSES / 64]; // Bit set when the bin is non-empty
+pthread_mutex_t memory_mutex;                   // Mutex for thread-safe memory operations
+
+static __thread ThreadCache *thread_cache = NULL; // Calling thread's cache
+static ThreadCache *idle_caches = NULL;           // Caches of exited threads, reused by new ones
+static pthread_key_t cache_key;                   // Flushes the cache when its thread exits
+
+// Helper function to align sizes
+size_t align_size(size_t size) {
+    return (size + (ALIGNMENT - 1)) & ~(ALIGNMENT - 1);
+}
+
+// Histogram bucket of a block size
+static int histogram_bucket(size_t size) {
+    int bucket = size ? 63 - __builtin_clzll((unsigned long long)size) : 0;
+    return bucket < ARENA_HISTOGRAM_BUCKETS ? bucket : ARENA_HISTOGRAM_BUCKETS - 1;
+}
+
+// Map a block size to its size class
+static int size_class(size_t size) {
+    if (size < SMALL_CLASS_LIMIT) {
+        return (int)(size / ALIGNMENT);
+    }
+
+    int msb = 63 - __builtin_clzll((unsigned long long)size);
+    int sub = (int)(size >> (msb - SUBCLASS_BITS)) & ((1 << SUBCLASS_BITS) - 1);
+    int index = (SMALL_CLASS_LIMIT / ALIGNMENT) + ((msb - 5) << SUBCLASS_BITS) + sub;
+
+    return index < NUM_SIZE_CLASSES ? index : NUM_SIZE_CLASSES - 1;
+}
+
+// Find the first non-empty bin at or above the given class, -1 if none
+static int find_bin(int index) {
+    for (int word = index / 64; word < NUM_SIZE_CLASSES / 64; word++) {
+        uint64_t bits = bin_map[word];
+        if (word == index / 64) {
+            bits &= ~0ULL << (index % 64);
+        }
+        if (bits) {
+            return word * 64 + __builtin_ctzll(bits);
+        }
+    }
+    return -1;
+}
+
+static void insert_into_bin(MemoryBlock *block) {
+    int index = size_class(block->size);
+
+    block->prev_free = NULL;
+    block->next_free = bins[index];
+    if (bins[index]) {
+        bins[index]->prev_free = block;
+    }
+    bins[index] = block;
+    bin_map[index / 64] |= 1ULL << (index % 64);
+
+    arena_stats.free_bytes += block->size;
+    arena_stats.free_blocks++;
+    arena_stats.free_histogram[histogram_bucket(block->size)]++;
+}
+
+static void remove_from_bin(MemoryBlock *block) {
+    int index = size_class(block->size);
+
+    if (block->prev_free) {
+        block->prev_free->next_free = block->next_free;
+    } else {
+        bins[index] = block->next_free;
+    }
+    if (block->next_free) {
+        block->next_free->prev_free = block->prev_free;
+    }
+    if (!bins[index]) {
+        bin_map[index / 64] &= ~(1ULL << (index % 64));
+    }
+    block->next_free = block->prev_free = NULL;
+
+    arena_stats.free_bytes -= block->size;
+    arena_stats.free_blocks--;
+    arena_stats.free_histogram[histogram_bucket(block->size)]--;
+}
+
+// Pick a free block of at least size bytes. Any block in a higher bin fits, so
+// only the request's own bin may need a (short) walk.
+static MemoryBlock *find_free_block(size_t size) {
+    int index = size_class(size);
+
+    if (bins[index] && bins[index]->size >= size) {
+        return bins[index];
+    }
+
+    int higher = index + 1 < NUM_SIZE_CLASSES ? find_bin(index + 1) : -1;
+    if (higher >= 0) {
+        return bins[higher];
+    }
+
+    for (MemoryBlock *current = bins[index]; current; current = current->next_free) {
+        if (current->size >= size) {
+            return current;
+        }
+    }
+    return NULL;
+}
+
+static MemoryBlock *chunk_first_block(ArenaChunk *chunk) {
+    return (MemoryBlock *)((char *)chunk + CHUNK_HEADER_SIZE);
+}
+
+// Map a new chunk big enough for a request of size bytes and put its single
+// free block in a bin, memory_mutex must be held
+static MemoryBlock *arena_grow_locked(size_t size) {
+    size_t granularity = arena_hugepages ? HUGE_PAGE_SIZE : (size_t)sysconf(_SC_PAGESIZE);
+    size_t length = CHUNK_HEADER_SIZE + sizeof(MemoryBlock) + size;
+    if (length < ARENA_SIZE) {
+        length = ARENA_SIZE;
+    }
+    length = (length + granularity - 1) & ~(granularity - 1);
+
+    void *memory = MAP_FAILED;
+    int huge = 0;
+    if (arena_hugepages) {
+        memory = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        huge = memory != MAP_FAILED;
+    }
+    if (memory == MAP_FAILED) {
+        memory = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (memory == MAP_FAILED) {
+            return NULL;
+        }
+        if (arena_hugepages) {
+            madvise(memory, length, MADV_HUGEPAGE); // No reserved hugepages, ask for THP instead
+        }
+    }
+
+    ArenaChunk *chunk = (ArenaChunk *)memory;
+    chunk->size = length;
+    chunk->huge = huge;
+    chunk->trimmed = 0;
+    chunk->prev = NULL;
+    chunk->next = arena;
+    if (arena) {
+        arena->prev = chunk;
+    }
+    arena = chunk;
+    arena_chunks++;
+    arena_stats.mapped_bytes += length;
+
+    MemoryBlock *block = chunk_first_block(chunk);
+    block->size = length - CHUNK_HEADER_SIZE - sizeof(MemoryBlock);
+    block->is_free = 1;
+    block->next = NULL;
+    block->prev = NULL;
+    insert_into_bin(block);
+    return block;
+}
+
+// Called when a free block spans its whole chunk. The chunk is unmapped
+// unless it is the last one, whose pages are only handed back with
+// MADV_DONTNEED so the next burst does not pay for a fresh mmap.
+// Returns 1 if the chunk (and the block) no longer exist.
+static int arena_release_chunk_locked(MemoryBlock *block) {
+    ArenaChunk *chunk = (ArenaChunk *)((char *)block - CHUNK_HEADER_SIZE);
+
+    if (arena_chunks > 1) {
+        if (chunk->prev) {
+            chunk->prev->next = chunk->next;
+        } else {
+            arena = chunk->next;
+        }
+        if (chunk->next) {
+            chunk->next->prev = chunk->prev;
+        }
+        arena_chunks--;
+        arena_stats.mapped_bytes -= chunk->size;
+        munmap(chunk, chunk->size);
+        return 1;
+    }
+
+    size_t granularity = chunk->huge ? HUGE_PAGE_SIZE : (size_t)sysconf(_SC_PAGESIZE);
+    size_t keep = (CHUNK_HEADER_SIZE + sizeof(MemoryBlock) + granularity - 1) & ~(granularity - 1);
+    if (!chunk->trimmed && chunk->size > keep) {
+        madvise((char *)chunk + keep, chunk->size - keep, MADV_DONTNEED);
+        chunk->trimmed = 1;
+    }
+    return 0;
+}
+
+// Allocate a block from the arena, memory_mutex must be held
+static MemoryBlock *arena_alloc_locked(size_t size) {
+    MemoryBlock *current = find_free_block(size);
+
+    if (!current) {
+        current = arena_grow_locked(size);
+    }
+    if (!current) {
+        return NULL; // No suitable block found and the arena cannot grow
+    }
+    remove_from_bin(current);
+    if (!current->prev && !current->next) {
+        ((ArenaChunk *)((char *)current - CHUNK_HEADER_SIZE))->trimmed = 0;
+    }
+
+    // Split the block if there's enough space for another block
+    if (current->size > size + sizeof(MemoryBlock)) {
+        MemoryBlock *new_block = (MemoryBlock *)((char *)current + sizeof(MemoryBlock) + size);
+        new_block->size = current->size - size - sizeof(MemoryBlock);
+        new_block->is_free = 1;
+        new_block->next = current->next;
+        new_block->prev = current;
+        if (new_block->next) {
+            new_block->next->prev = new_block;
+        }
+        insert_into_bin(new_block);
+
+        current->size = size;
+        current->next = new_block;
+    }
+
+    current->is_free = 0;
+    current->cache_class = -1;
+    current->owner = NULL;
+
+    arena_stats.used_bytes += current->size;
+    arena_stats.used_blocks++;
+    arena_stats.used_histogram[histogram_bucket(current->size)]++;
+    return current;
+}
+
+// Return a block to the arena, memory_mutex must be held
+static void arena_free_locked(MemoryBlock *block) {
+    arena_stats.used_bytes -= block->size;
+    arena_stats.used_blocks--;
+    arena_stats.used_histogram[histogram_bucket(block->size)]--;
+
+    block->is_free = 1;
+    block->cache_class = -1;
+    block->owner = NULL;
+
+    // Merge with the physical neighbours. Free neighbours sit in a bin, so
+    // pull them out of theirs before the merged block goes back in.
+    MemoryBlock *next = block->next;
+    if (next && next->is_free) {
+        remove_from_bin(next);
+        block->size += sizeof(MemoryBlock) + next->size;
+        block->next = next->next;
+        if (block->next) {
+            block->next->prev = block;
+        }
+    }
+
+    MemoryBlock *prev = block->prev;
+    if (prev && prev->is_free) {
+        remove_from_bin(prev);
+        prev->size += sizeof(MemoryBlock) + block->size;
+        prev->next = block->next;
+        if (prev->next) {
+            prev->next->prev = prev;
+        }
+        block = prev;
+    }
+
+    if (!block->prev && !block->next && arena_release_chunk_locked(block)) {
+        return;
+    }
+    insert_into_bin(block);
+}
+
+// Map a request size to its thread cache class
+static int cache_class_of(size_t size) {
+    if (size <= (1 << CACHE_MIN_SHIFT)) {
+        return 0;
+    }
+    return 64 - __builtin_clzll((unsigned long long)(size - 1)) - CACHE_MIN_SHIFT;
+}
+
+// Hand every block left in a cache back to the arena, memory_mutex must be held
+static void cache_release_locked(ThreadCache *cache) {
+    for (int cls = 0; cls < CACHE_CLASSES; cls++) {
+        while (cache->count[cls] > 0) {
+            arena_free_locked(cache->blocks[cls][--cache->count[cls]]);
+        }
+    }
+    MemoryBlock *block = atomic_exchange_explicit(&cache->remote_free, NULL, memory_order_acquire);
+    while (block) {
+        MemoryBlock *next = block->next_free;
+        arena_free_locked(block);
+        block = next;
+    }
+}
+
+// pthread key destructor: give the cache back when its thread exits. Remote
+// frees that arrive afterwards wait on remote_free for the next adopter.
+static void cache_thread_exit(void *arg) {
+    ThreadCache *cache = (ThreadCache *)arg;
+
+    pthread_mutex_lock(&memory_mutex);
+    cache_release_locked(cache);
+    cache->next_idle = idle_caches;
+    idle_caches = cache;
+    pthread_mutex_unlock(&memory_mutex);
+    thread_cache = NULL;
+}
+
+// Get (or adopt) the calling thread's cache, NULL if the arena is exhausted
+static ThreadCache *get_thread_cache() {
+    if (thread_cache) {
+        return thread_cache;
+    }
+
+    pthread_mutex_lock(&memory_mutex);
+    ThreadCache *cache = idle_caches;
+    if (cache) {
+        idle_caches = cache->next_idle;
+    } else {
+        MemoryBlock *block = arena_alloc_locked(align_size(sizeof(ThreadCache)));
+        if (block) {
+            cache = (ThreadCache *)((char *)block + sizeof(MemoryBlock));
+            memset(cache, 0, sizeof(ThreadCache));
+            atomic_init(&cache->remote_free, NULL);
+        }
+    }
+    pthread_mutex_unlock(&memory_mutex);
+
+    if (cache) {
+        cache->next_idle = NULL;
+        pthread_setspecific(cache_key, cache);
+        thread_cache = cache;
+    }
+    return cache;
+}
+
+// Move blocks freed by other threads into the magazines. Blocks that do not
+// fit are collected and returned to the arena under a single lock.
+static void cache_drain_remote(ThreadCache *cache) {
+    MemoryBlock *block = atomic_exchange_explicit(&cache->remote_free, NULL, memory_order_acquire);
+    MemoryBlock *overflow = NULL;
+
+    while (block) {
+        MemoryBlock *next = block->next_free;
+        int cls = block->cache_class;
+        if (cache->count[cls] < MAGAZINE_SIZE) {
+            cache->blocks[cls][cache->count[cls]++] = block;
+        } else {
+            block->next_free = overflow;
+            overflow = block;
+        }
+        block = next;
+    }
+
+    if (overflow) {
+        pthread_mutex_lock(&memory_mutex);
+        while (overflow) {
+            MemoryBlock *next = overflow->next_free;
+            arena_free_locked(overflow);
+            overflow = next;
+        }
+        pthread_mutex_unlock(&memory_mutex);
+    }
+}
+
+// Refill an empty magazine with a batch of blocks carved under one lock
+static void cache_refill(ThreadCache *cache, int cls) {
+    size_t size = (size_t)1 << (cls + CACHE_MIN_SHIFT);
+
+    pthread_mutex_lock(&memory_mutex);
+    while (cache->count[cls] < CACHE_BATCH) {
+        MemoryBlock *block = arena_alloc_locked(size);
+        if (!block) break;
+        block->cache_class = cls;
+        block->owner = cache;
+        cache->blocks[cls][cache->count[cls]++] = block;
+    }
+    pthread_mutex_unlock(&memory_mutex);
+}
+
+// Flush half of a full magazine back to the arena under one lock
+static void cache_flush(ThreadCache *cache, int cls) {
+    pthread_mutex_lock(&memory_mutex);
+    while (cache->count[cls] > MAGAZINE_SIZE - CACHE_BATCH) {
+        arena_free_locked(cache->blocks[cls][--cache->count[cls]]);
+    }
+    pthread_mutex_unlock(&memory_mutex);
+}
+
+// Append one allocation ("a tid ptr size") or free ("f tid ptr") to the
+// trace. Frees are logged before the block is released and allocations
+// after, so a reused address always shows up in the right order.
+static void arena_trace_record(char op, void *ptr, size_t size) {
+    if (arena_trace_tid < 0) {
+        arena_trace_tid = atomic_fetch_add(&arena_trace_threads, 1);
+    }
+    if (op == 'a') {
+        fprintf(arena_trace, "a %d %p %zu\n", arena_trace_tid, ptr, size);
+    } else {
+        fprintf(arena_trace, "f %d %p\n", arena_trace_tid, ptr);
+    }
+}
+
+// Initialize the arena
+void initialize_arena() {
+    if (!arena) {
+        const char *hugepages = getenv("ARENA_HUGEPAGES");
+        arena_hugepages = hugepages && strcmp(hugepages, "1") == 0;
+
+        const char *trace_path = getenv("ARENA_TRACE");
+        if (trace_path && *trace_path) {
+            arena_trace = fopen(trace_path, "w");
+            if (arena_trace) {
+                setvbuf(arena_trace, NULL, _IOLBF, 0); // Keep the trace usable if the server is killed
+            } else {
+                perror("Failed to open allocation trace");
+            }
+        }
+
+        // Start with one chunk, more are mapped on demand
+        if (!arena_grow_locked(ARENA_SIZE - CHUNK_HEADER_SIZE - sizeof(MemoryBlock))) {
+            fprintf(stderr, "Failed to allocate memory arena.\n");
+            exit(EXIT_FAILURE);
+        }
+
+        pthread_mutex_init(&memory_mutex, NULL);
+        pthread_key_create(&cache_key, cache_thread_exit);
+        printf("Memory arena initialized with size: %zu bytes%s\n", arena->size,
+               arena->huge ? " (hugepages)" : "");
+    }
+}
+
+// Snapshot the allocator counters. Only the largest free block needs a
+// look at the blocks, and only at those in the highest non-empty bin.
+void arena_get_stats(ArenaStats *stats) {
+    pthread_mutex_lock(&memory_mutex);
+    *stats = arena_stats;
+    stats->chunks = arena_chunks;
+    stats->largest_free_block = 0;
+    for (int index = NUM_SIZE_CLASSES - 1; index >= 0; index--) {
+        if (!bins[index]) continue;
+        for (MemoryBlock *current = bins[index]; current; current = current->next_free) {
+            if (current->size > stats->largest_free_block) {
+                stats->largest_free_block = current->size;
+            }
+        }
+        break;
+    }
+    pthread_mutex_unlock(&memory_mutex);
+
+    stats->fragmentation = stats->free_bytes
+        ? 1.0 - (double)stats->largest_free_block / (double)stats->free_bytes
+        : 0.0;
+}
+
+void calculate_arena_space(size_t *used_space, size_t *free_space) {
+    pthread_mutex_lock(&memory_mutex);
+    *used_space = arena_stats.used_bytes;
+    *free_space = arena_stats.free_bytes;
+    pthread_mutex_unlock(&memory_mutex);
+}
+
+void print_arena_space() {
+    ArenaStats stats;
+    arena_get_stats(&stats);
+    printf("Arena Space: Used = %zu bytes, Free = %zu bytes, Largest free = %zu bytes, "
+           "Fragmentation = %.1f%%, Chunks = %d\n",
+           stats.used_bytes, stats.free_bytes, stats.largest_free_block,
+           stats.fragmentation * 100.0, stats.chunks);
+}
+
+void print_arena_histogram() {
+    ArenaStats stats;
+    arena_get_stats(&stats);
+    printf("Block size histogram (used / free):\n");
+    for (int bucket = 0; bucket < ARENA_HISTOGRAM_BUCKETS; bucket++) {
+        if (stats.used_histogram[bucket] || stats.free_histogram[bucket]) {
+            printf("  >= %12zu bytes: %8zu / %8zu\n", (size_t)1 << bucket,
+                   stats.used_histogram[bucket], stats.free_histogram[bucket]);
+        }
+    }
+}
+
+// Allocation path behind mymalloc
+static void *arena_malloc(size_t size) {
+    size = align_size(size); // Align the requested size
+
+    // Small requests come from the thread cache without touching memory_mutex
+    if (size <= CACHE_MAX_SIZE) {
+        ThreadCache *cache = get_thread_cache();
+        if (cache) {
+            int cls = cache_class_of(size);
+            if (cache->count[cls] == 0) {
+                cache_drain_remote(cache);
+            }
+            if (cache->count[cls] == 0) {
+                cache_refill(cache, cls);
+            }
+            if (cache->count[cls] > 0) {
+                MemoryBlock *block = cache->blocks[cls][--cache->count[cls]];
+                return (char *)block + sizeof(MemoryBlock);
+            }
+        }
+    }
+
+    pthread_mutex_lock(&memory_mutex);
+    MemoryBlock *current = arena_alloc_locked(size);
+    if (!current) {
+        pthread_mutex_unlock(&memory_mutex);
+        return NULL; // No suitable block found
+    }
+    pthread_mutex_unlock(&memory_mutex);
+
+    return (char *)current + sizeof(MemoryBlock);
+}
+
+// Custom malloc implementation
+void *mymalloc(size_t size) {
+    void *ptr = arena_malloc(size);
+    if (arena_trace && ptr) {
+        arena_trace_record('a', ptr, size);
+    }
+    return ptr;
+}
+
+// Custom free implementation
+void myfree(void *ptr) {
+    if (!ptr) return;
+    if (arena_trace) {
+        arena_trace_record('f', ptr, 0);
+    }
+
+    MemoryBlock *block = (MemoryBlock *)((char *)ptr - sizeof(MemoryBlock));
+
+    // Cached blocks go back to the cache they came from: straight into the
+    // magazine for the owner, onto its lock-free remote list for anyone else.
+    if (block->owner) {
+        ThreadCache *owner = block->owner;
+        if (owner == thread_cache) {
+            int cls = block->cache_class;
+            if (owner->count[cls] == MAGAZINE_SIZE) {
+                cache_flush(owner, cls);
+            }
+            owner->blocks[cls][owner->count[cls]++] = block;
+        } else {
+            MemoryBlock *head = atomic_load_explicit(&owner->remote_free, memory_order_relaxed);
+            do {
+                block->next_free = head;
+            } while (!atomic_compare_exchange_weak_explicit(&owner->remote_free, &head, block,
+                                                            memory_order_release, memory_order_relaxed));
+        }
+        return;
+    }
+
+    pthread_mutex_lock(&memory_mutex);
+    arena_free_locked(block);
+    pthread_mutex_unlock(&memory_mutex);
+}
+
+// Request-scoped region: a bump allocator over blocks carved from the arena.
+// Everything allocated from a region is released at once by region_reset
+// (keeps the first block for reuse) or region_destroy.
+#define REGION_BLOCK_SIZE (32 * 1024)
+
+typedef struct RegionBlock {
+    struct RegionBlock *next; // Previously filled block
+    size_t size;              // Usable bytes after this header
+    size_t used;              // Bytes handed out so far
+} RegionBlock;
+
+typedef struct Region {
+    RegionBlock *head;        // Block currently being filled
+    size_t block_size;        // Usable size of each new block
+} Region;
+
+void region_init(Region *region, size_t block_size) {
+    region->head = NULL;
+    region->block_size = block_size ? block_size : REGION_BLOCK_SIZE;
+}
+
+// Uninitialized memory that lives until the region is reset, NULL if the arena is exhausted
+void *region_alloc(Region *region, size_t size) {
+    size = align_size(size);
+
+    RegionBlock *block = region->head;
+    if (!block || block->size - block->used < size) {
+        size_t block_size = size > region->block_size ? size : region->block_size;
+        block = mymalloc(sizeof(RegionBlock) + block_size);
+        if (!block) {
+            return NULL;
+        }
+        block->size = block_size;
+        block->used = 0;
+        block->next = region->head;
+        region->head = block;
+    }
+
+    void *ptr = (char *)(block + 1) + block->used;
+    block->used += size;
+    return ptr;
+}
+
+// Zero-filled variant of region_alloc
+void *region_zalloc(Region *region, size_t size) {
+    void *ptr = region_alloc(region, size);
+    if (ptr) {
+        memset(ptr, 0, size);
+    }
+    return ptr;
+}
+
+// Release everything allocated from the region but keep its oldest block
+void region_reset(Region *region) {
+    RegionBlock *block = region->head;
+    while (block && block->next) {
+        RegionBlock *next = block->next;
+        myfree(block);
+        block = next;
+    }
+    if (block) {
+        block->used = 0;
+    }
+    region->head = block;
+}
+
+void region_destroy(Region *region) {
+    region_reset(region);
+    myfree(region->head);
+    region->head = NULL;
+}
+
+// Object pool for fixed-size structures. Objects are carved from the arena a
+// slab at a time and constructed once; freed objects keep their state and go
+// back on an intrusive free list. Frees are lock-free pushes onto returned,
+// which slab_alloc takes over wholesale when its own list runs dry.
+#define SLAB_OBJECTS 256
+
+typedef struct SlabObject {
+    struct SlabObject *next;  // Next free object
+} SlabObject;
+
+typedef struct Slab {
+    size_t object_size;                // Size of each object, header excluded
+    int objects_per_slab;              // Objects carved per arena allocation
+    void (*construct)(void *object);   // Run once per object, may be NULL
+    SlabObject *free_list;             // Free objects, guarded by lock
+    _Atomic(SlabObject *) returned;    // Objects freed since the last refill
+    pthread_mutex_t lock;
+} Slab;
+
+#define SLAB_HEADER_SIZE ((sizeof(SlabObject) + ALIGNMENT - 1) & ~(size_t)(ALIGNMENT - 1))
+
+// Carve and construct one more slab, slab->lock must be held
+static int slab_grow_locked(Slab *slab) {
+    size_t stride = SLAB_HEADER_SIZE + align_size(slab->object_size);
+    char *memory = mymalloc(stride * slab->objects_per_slab);
+    if (!memory) {
+        return -1;
+    }
+
+    for (int i = slab->objects_per_slab - 1; i >= 0; i--) {
+        SlabObject *object = (SlabObject *)(memory + stride * i);
+        if (slab->construct) {
+            slab->construct((char *)object + SLAB_HEADER_SIZE);
+        }
+        object->next = slab->free_list;
+        slab->free_list = object;
+    }
+    return 0;
+}
+
+// Set up a pool with its first slab already constructed, -1 if the arena is exhausted
+int slab_init(Slab *slab, size_t object_size, int objects_per_slab, void (*construct)(void *object)) {
+    slab->object_size = object_size;
+    slab->objects_per_slab = objects_per_slab > 0 ? objects_per_slab : SLAB_OBJECTS;
+    slab->construct = construct;
+    slab->free_list = NULL;
+    atomic_init(&slab->returned, NULL);
+    pthread_mutex_init(&slab->lock, NULL);
+    return slab_grow_locked(slab);
+}
+
+void *slab_alloc(Slab *slab) {
+    pthread_mutex_lock(&slab->lock);
+    if (!slab->free_list) {
+        slab->free_list = atomic_exchange_explicit(&slab->returned, NULL, memory_order_acquire);
+    }
+    if (!slab->free_list && slab_grow_locked(slab) != 0) {
+        pthread_mutex_unlock(&slab->lock);
+        return NULL;
+    }
+    SlabObject *object = slab->free_list;
+    slab->free_list = object->next;
+    pthread_mutex_unlock(&slab->lock);
+
+    return (char *)object + SLAB_HEADER_SIZE;
+}
+
+void slab_free(Slab *slab, void *ptr) {
+    if (!ptr) return;
+
+    SlabObject *object = (SlabObject *)((char *)ptr - SLAB_HEADER_SIZE);
+    SlabObject *head = atomic_load_explicit(&slab->returned, memory_order_relaxed);
+    do {
+        object->next = head;
+    } while (!atomic_compare_exchange_weak_explicit(&slab->returned, &head, object,
+                                                    memory_order_release, memory_order_relaxed));
+}
+
+#endif // ARENA_H
@@ -220,9 +220,19 @@
 #include <arpa/inet.h>  // For inet_addr() and htons()
 #include <sys/socket.h> // For socket(), connect(), send(), recv()
 #include <ctype.h>      // For isdigit()
+#include <time.h>       // For time() and nanosleep()
+#include <poll.h>       // For poll()
+#include <pthread.h>    // For the connections of a segmented transfer
+
+#include "protocol.h"
 
 #define PORT 8001
 #define BUFFER_SIZE 2048
+#define MAX_BUSY_RETRIES 6   // Attempts after a busy reply before giving up
+#define BACKOFF_BASE_MS 50   // First backoff, doubled on every retry
+#define BACKOFF_MAX_MS 5000
+#define PIPELINE_DEPTH 32    // Requests sent ahead of their replies
+#define MAX_SEGMENTS 16      // Parallel connections of one segmented transfer
 
 void encode_content(const char *input, char *output) {
     int input_length = strlen(input);
@@ -270,113 +280,857 @@ void decode_content(const char *input, char *output) {
     output[output_index] = '\0'; // Null-terminate the output
 }
 
-int main() {
+// Fields of the client's command file
+struct command {
+    char command[BUFFER_SIZE];
+    char id[PROTOCOL_ID_SIZE];
+    char filename[BUFFER_SIZE]; // Name on the server
+    char filepath[BUFFER_SIZE]; // Local source of an upload
+    long long offset;           // Download range start, in stored (encoded) bytes
+    long long length;           // Download range length, 0 for the rest of the file
+    int segments;               // Byte ranges to transfer over parallel connections, 0 or 1 for one
+    MessageHeader request;      // Built from the fields above
+    FILE *file_to_send;         // Open source of an upload
+    int resume;                 // Upload continuing a partial file, asks for its size first
+    unsigned long long total;   // Encoded length of the whole upload, or the size a stat found
+
+    // Stream state on a multiplexed connection
+    int open;                   // Request sent, result not yet in
+    long long remaining;        // Upload content to send, or content to receive (-1 before the reply)
+    long long window;           // Upload bytes the server lets us send
+    long long consumed;         // Received bytes not yet granted back
+    char *received;             // Download or view content, printed once complete
+    size_t received_length;
+    char pending[BUFFER_SIZE];  // Encoded upload chunk being sent
+    size_t pending_length;
+    size_t pending_sent;
+};
+
+// Read the command file at path into a zeroed command. Returns -1 if it
+// cannot be opened.
+int parse_command_file(const char *path, struct command *command) {
+    FILE *file = fopen(path, "r");
+    char line[BUFFER_SIZE];
+
+    if (file == NULL) {
+        printf("Could not open file: %s\n", path);
+        return -1;
+    }
+
+    // Simple parsing, assuming JSON format {"command": "upload", "filename": "example.txt"}
+    memset(command, 0, sizeof(struct command));
+    while (fgets(line, sizeof(line), file) != NULL) {
+        if (strstr(line, "\"command\":") != NULL) {
+            sscanf(line, " \"command\": \"%[^\"]\"", command->command);
+        } else if (strstr(line, "\"ID\":") != NULL) {
+            sscanf(line, " \"ID\": \"%15[^\"]\"", command->id); // PROTOCOL_ID_SIZE - 1
+        } else if (strstr(line, "\"filename\":") != NULL) {
+            sscanf(line, " \"filename\": \"%[^\"]\"", command->filename);
+        } else if (strstr(line, "\"filepath\":") != NULL) {
+            sscanf(line, " \"filepath\": \"%[^\"]\"", command->filepath);
+        } else if (strstr(line, "\"offset\":") != NULL) {
+            sscanf(line, " \"offset\": %lld", &command->offset);
+        } else if (strstr(line, "\"length\":") != NULL) {
+            sscanf(line, " \"length\": %lld", &command->length);
+        } else if (strstr(line, "\"segments\":") != NULL) {
+            sscanf(line, " \"segments\": %d", &command->segments);
+        }
+    }
+    fclose(file);
+
+    // An upload is stored under the source file's own name
+    if (command->filename[0] == '\0' && command->filepath[0] != '\0') {
+        const char *last_slash = strrchr(command->filepath, '/');
+        snprintf(command->filename, sizeof(command->filename), "%s", last_slash ? last_slash + 1 : command->filepath);
+    }
+    return 0;
+}
+
+// Read and encode the next chunk of file. Returns the encoded length, 0 at
+// the end of the file.
+size_t read_encoded_chunk(FILE *file, char *encoded) {
+    char file_chunk[BUFFER_SIZE / 2]; // Encoding at most doubles a chunk
+    size_t bytes_read = fread(file_chunk, 1, sizeof(file_chunk) - 1, file);
+
+    file_chunk[bytes_read] = '\0';
+    encode_content(file_chunk, encoded);
+    return strlen(encoded);
+}
+
+// Connect to the server. Returns the socket, or -1.
+int connect_to_server(struct sockaddr_in *server) {
     int sock;
-    struct sockaddr_in server;
-    char *message = "/home/sana-hashim/Desktop/bscs22101_bscs22017_Group_D_OS-main/command.txt";
-    char server_response[BUFFER_SIZE] = {0};
-    char file_content[BUFFER_SIZE] = {0};
 
     // Create socket
     if ((sock = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
         perror("Socket creation failed");
-        return 1;
+        return -1;
     }
 
-    // Setup server address structure
-    server.sin_family = AF_INET;
-    server.sin_port = htons(PORT);
-    server.sin_addr.s_addr = inet_addr("127.0.0.1");
-
     // Connect to server
-    if (connect(sock, (struct sockaddr *)&server, sizeof(server)) < 0) {
+    if (connect(sock, (struct sockaddr *)server, sizeof(*server)) < 0) {
         perror("Connection failed");
         close(sock);
-        return 1;
+        return -1;
+    }
+    return sock;
+}
+
+// Build the request header of command, opening an upload's source file.
+// Returns -1 if the command cannot be sent.
+int prepare_request(struct command *command, uint32_t request_id) {
+    MessageHeader *request = &command->request;
+    char content[BUFFER_SIZE];
+
+    memset(request, 0, sizeof(MessageHeader));
+    snprintf(request->id, sizeof(request->id), "%s", command->id);
+    request->request_id = request_id;
+    if (strcmp(command->command, "upload") == 0 || strcmp(command->command, "resume") == 0) {
+        command->file_to_send = fopen(command->filepath, "rb");
+        if (command->file_to_send == NULL) {
+            printf("Error: Could not open file %s for reading.\n", command->filepath);
+            return -1;
+        }
+
+        // The header carries the length, so encode once to measure it
+        size_t encoded;
+        while ((encoded = read_encoded_chunk(command->file_to_send, content)) > 0) {
+            request->payload_length += encoded;
+        }
+        rewind(command->file_to_send);
+        request->opcode = OP_UPLOAD;
+        command->total = request->payload_length;
+        command->resume = strcmp(command->command, "resume") == 0;
+    } else if (strcmp(command->command, "download") == 0) {
+        if (command->offset < 0 || command->length < 0) {
+            printf("Bad range: offset %lld, length %lld\n", command->offset, command->length);
+            return -1;
+        }
+        request->opcode = OP_DOWNLOAD;
+        request->offset = command->offset;
+        request->length = command->length;
+    } else if (strcmp(command->command, "stat") == 0) {
+        request->opcode = OP_STAT;
+    } else if (strcmp(command->command, "view") == 0) {
+        request->opcode = OP_VIEW;
+        command->filename[0] = '\0';
+    } else {
+        printf("Unknown command: %s\n", command->command);
+        return -1;
+    }
+    if (strlen(command->filename) > PROTOCOL_NAME_MAX) {
+        printf("File name too long: %s\n", command->filename);
+        return -1;
+    }
+    request->name_length = strlen(command->filename);
+    return 0;
+}
+
+// The request a resumed upload starts with: the size of what is stored
+MessageHeader stat_request(const struct command *command) {
+    MessageHeader request = command->request;
+
+    request.opcode = OP_STAT;
+    request.payload_length = 0;
+    return request;
+}
+
+// Skip the first offset bytes of an upload's encoded content; the rest of the
+// chunk the offset falls in waits in pending. Returns -1 if the content is
+// shorter than offset.
+int skip_encoded(struct command *command, unsigned long long offset) {
+    rewind(command->file_to_send);
+    command->pending_length = command->pending_sent = 0;
+    while (offset > 0) {
+        command->pending_length = read_encoded_chunk(command->file_to_send, command->pending);
+        if (command->pending_length == 0) {
+            return -1;
+        }
+        command->pending_sent = offset < command->pending_length ? offset : command->pending_length;
+        offset -= command->pending_sent;
     }
+    return 0;
+}
 
-    // Send the command file path to the server
-    if (send(sock, message, strlen(message), 0) < 0) {
+// Send the upload of a resumed command once the stat reply says how much of
+// it the server has. Anything unusable (no file, or more than this content)
+// starts over from byte 0. Returns -1 if the connection failed.
+int start_resumed_upload(int sock, struct command *command, const MessageHeader *stat_reply) {
+    unsigned long long offset = stat_reply->status == STATUS_OK ? stat_reply->length : 0;
+
+    if (offset > command->total || skip_encoded(command, offset) != 0) {
+        offset = 0;
+        skip_encoded(command, 0);
+    }
+    command->request.offset = offset;
+    command->request.payload_length = command->total - offset;
+    printf("Resuming '%s' at byte %llu of %llu\n", command->filename, offset, command->total);
+    if (protocol_send(sock, &command->request, command->filename) != 0) {
         perror("Send failed");
-        close(sock);
-        return 1;
+        return -1;
     }
+    return 0;
+}
+
+// Retry hint of a busy reply, -1 for any other reply
+int busy_retry_after(int sock, const MessageHeader *reply) {
+    uint32_t retry_after;
+
+    if (reply->opcode != OP_NONE || reply->status != STATUS_BUSY || reply->payload_length != sizeof(retry_after) ||
+        recv_all(sock, &retry_after, sizeof(retry_after)) != 0) {
+        return -1;
+    }
+    return (int)be32toh(retry_after);
+}
+
+// Exponential backoff, at least the server's hint, with equal jitter so
+// clients turned away together do not all come back at once
+void backoff(int attempt, int retry_after) {
+    long delay = (long)BACKOFF_BASE_MS << attempt;
 
-    printf("File path sent to server.\n");
+    if (delay > BACKOFF_MAX_MS) {
+        delay = BACKOFF_MAX_MS;
+    }
+    if (delay < retry_after) {
+        delay = retry_after;
+    }
+    delay = delay / 2 + rand() % (delay / 2 + 1);
+    printf("Server busy, retrying in %ld ms\n", delay);
 
-    // Receive server response
-    int bytes_received = recv(sock, server_response, sizeof(server_response) - 1, 0);
-    if (bytes_received > 0) {
-        server_response[bytes_received] = '\0'; // Null-terminate
-        printf("Server response: %s\n", server_response); // Log the response
+    struct timespec pause = {delay / 1000, (delay % 1000) * 1000000L};
+    nanosleep(&pause, NULL);
+}
 
-        // Response handling
-        if (strstr(server_response, "Success: Ready to receive file.") != NULL) {
-            FILE *file = fopen(message, "r");
-            if (file == NULL) {
-                printf("Could not open file: %s\n", message);
-                close(sock);
-                return 0;
+// Finish command once its reply header has arrived. Returns 0 if the
+// connection can carry on, -1 if it was lost.
+int handle_reply(int sock, struct command *command, const MessageHeader *reply) {
+    char file_content[BUFFER_SIZE] = {0};
+    char content[BUFFER_SIZE] = {0};
+    unsigned long long remaining = reply->payload_length;
+
+    if (reply->status != STATUS_OK) {
+        printf("Server response: Failure: %s\n", protocol_status_text(reply->status));
+    } else if (command->request.opcode == OP_UPLOAD) {
+        MessageHeader stored;
+        size_t encoded;
+
+        // Ready: send the encoded content from the resume point on, then
+        // wait for it to be stored
+        if (command->pending_sent < command->pending_length &&
+            send_all(sock, command->pending + command->pending_sent, command->pending_length - command->pending_sent) != 0) {
+            printf("Upload of '%s' failed: connection lost\n", command->filepath);
+            return -1;
+        }
+        while ((encoded = read_encoded_chunk(command->file_to_send, content)) > 0) {
+            if (send_all(sock, content, encoded) != 0) {
+                printf("Upload of '%s' failed: connection lost\n", command->filepath);
+                return -1;
+            }
+        }
+        if (protocol_recv(sock, &stored) != 0) {
+            printf("Upload of '%s' failed: connection lost\n", command->filepath);
+            return -1;
+        }
+        if (stored.status != STATUS_OK) {
+            printf("Upload of '%s' failed: %s\n", command->filepath, protocol_status_text(stored.status));
+        } else {
+            printf("File '%s' sent successfully.\n", command->filepath);
+        }
+    } else if (command->request.opcode == OP_STAT) {
+        printf("File '%s': %llu bytes stored\n", command->filename, (unsigned long long)reply->length);
+    } else if (command->request.opcode == OP_DOWNLOAD) {
+        // Even-sized chunks keep every count and character pair together
+        printf("File content: ");
+        while (remaining > 0) {
+            size_t chunk = remaining < BUFFER_SIZE - 2 ? remaining : BUFFER_SIZE - 2;
+            if (recv_all(sock, file_content, chunk) != 0) {
+                printf("\nServer closed the connection\n");
+                return -1;
+            }
+            file_content[chunk] = '\0';
+            decode_content(file_content, content);
+            printf("%s", content); // Print decoded content
+            remaining -= chunk;
+        }
+        printf("\n");
+    } else {
+        printf("Files in directory received from server:\n");
+        while (remaining > 0) {
+            size_t chunk = remaining < BUFFER_SIZE - 1 ? remaining : BUFFER_SIZE - 1;
+            if (recv_all(sock, file_content, chunk) != 0) {
+                printf("Server closed the connection\n");
+                return -1;
             }
+            file_content[chunk] = '\0';
+            printf("%s", file_content);
+            remaining -= chunk;
+        }
+        printf("\n");
+    }
+    return 0;
+}
 
-            char command[BUFFER_SIZE] = {0};
-            char filepath[BUFFER_SIZE] = {0};
-            char line[BUFFER_SIZE];
-
-            // Simple parsing of the command file
-            while (fgets(line, sizeof(line), file) != NULL) {
-                if (strstr(line, "\"command\":") != NULL) {
-                    sscanf(line, " \"command\": \"%[^\"]\"", command);
-                } else if (strstr(line, "\"filepath\":") != NULL) {
-                    sscanf(line, " \"filepath\": \"%[^\"]\"", filepath);
-                }
+// Run every command over one connection. Requests go out up to
+// PIPELINE_DEPTH ahead of their replies, which come back in order; an upload
+// holds the pipeline until its ready reply, since its content follows.
+// Starts at command *answered and counts up as replies arrive. Returns 0 when
+// all are answered, 1 with *retry_after set if the server turned the next
+// request away as busy, -1 if the connection failed.
+int run_commands(int sock, struct command *commands, int count, int *answered, int *retry_after) {
+    int sent = *answered;
+    int upload_waiting = 0;
+
+    while (*answered < count) {
+        while (sent < count && sent - *answered < PIPELINE_DEPTH && !upload_waiting) {
+            MessageHeader request = commands[sent].resume ? stat_request(&commands[sent]) : commands[sent].request;
+            if (protocol_send(sock, &request, commands[sent].filename) != 0) {
+                perror("Send failed");
+                return -1;
             }
-            fclose(file);
+            upload_waiting = commands[sent].request.opcode == OP_UPLOAD;
+            sent++;
+        }
 
-            FILE *file_to_send = fopen(filepath, "rb");
-            if (file_to_send == NULL) {
-                printf("Error: Could not open file %s for reading.\n", filepath);
-                close(sock);
-                return 0;
+        MessageHeader reply;
+        if (protocol_recv(sock, &reply) != 0) {
+            printf("Failed to receive response from server\n");
+            return -1;
+        }
+        if ((*retry_after = busy_retry_after(sock, &reply)) >= 0) {
+            return 1;
+        }
+
+        struct command *command = &commands[*answered];
+        if (reply.request_id != command->request.request_id) {
+            printf("Reply to request %u arrived out of order\n", reply.request_id);
+            return -1;
+        }
+        if (command->resume && reply.opcode == OP_STAT) {
+            // The upload itself goes out now; its ready reply is next
+            if (start_resumed_upload(sock, command, &reply) != 0) {
+                return -1;
             }
+            continue;
+        }
+        if (count > 1) {
+            printf("[%u] %s %s\n", reply.request_id, command->command, command->filename);
+        }
+        if (handle_reply(sock, command, &reply) != 0) {
+            return -1;
+        }
+        if (command->request.opcode == OP_UPLOAD) {
+            upload_waiting = 0;
+        }
+        (*answered)++;
+    }
+    return 0;
+}
+
+// Print the result of a finished stream the way handle_reply does
+void print_stream_result(struct command *command, int status) {
+    char file_content[BUFFER_SIZE] = {0};
+    char content[BUFFER_SIZE] = {0};
+
+    printf("[%u] %s %s\n", command->request.request_id, command->command, command->filename);
+    if (status != STATUS_OK) {
+        printf("Server response: Failure: %s\n", protocol_status_text(status));
+    } else if (command->request.opcode == OP_UPLOAD) {
+        printf("File '%s' sent successfully.\n", command->filepath);
+    } else if (command->request.opcode == OP_STAT) {
+        printf("File '%s': %llu bytes stored\n", command->filename, command->total);
+    } else if (command->request.opcode == OP_DOWNLOAD) {
+        // Even-sized chunks keep every count and character pair together
+        printf("File content: ");
+        for (size_t offset = 0; offset < command->received_length; offset += BUFFER_SIZE - 2) {
+            size_t chunk = command->received_length - offset < BUFFER_SIZE - 2 ? command->received_length - offset : BUFFER_SIZE - 2;
+            memcpy(file_content, command->received + offset, chunk);
+            file_content[chunk] = '\0';
+            decode_content(file_content, content);
+            printf("%s", content);
+        }
+        printf("\n");
+    } else {
+        printf("Files in directory received from server:\n%.*s\n", (int)command->received_length, command->received);
+    }
+    command->open = 0;
+    free(command->received);
+    command->received = NULL;
+}
+
+// Send the next DATA frame of an upload stream, as much as its window and
+// PROTOCOL_FRAME_MAX allow. Returns -1 if the connection failed.
+int send_stream_data(int sock, struct command *command) {
+    unsigned char frame[PROTOCOL_HEADER_SIZE + BUFFER_SIZE];
+    MessageHeader header = {.opcode = OP_DATA, .request_id = command->request.request_id};
+
+    if (command->pending_sent == command->pending_length) {
+        command->pending_length = read_encoded_chunk(command->file_to_send, command->pending);
+        command->pending_sent = 0;
+        if (command->pending_length == 0) {
+            printf("Upload of '%s' failed: the file changed while it was sent\n", command->filepath);
+            return -1;
+        }
+    }
 
-            char file_chunk[BUFFER_SIZE];
-            int bytes_read;
+    size_t length = command->pending_length - command->pending_sent;
+    if ((long long)length > command->window) length = command->window;
+    if ((long long)length > command->remaining) length = command->remaining;
+    if (length > PROTOCOL_FRAME_MAX) length = PROTOCOL_FRAME_MAX;
+    header.payload_length = length;
+    protocol_encode(&header, frame);
+    memcpy(frame + PROTOCOL_HEADER_SIZE, command->pending + command->pending_sent, length);
+    if (send_all(sock, frame, PROTOCOL_HEADER_SIZE + length) != 0) {
+        perror("Send failed");
+        return -1;
+    }
+    command->pending_sent += length;
+    command->remaining -= length;
+    command->window -= length;
+    return 0;
+}
 
-            // Read the file in chunks and send to the server
-            while ((bytes_read = fread(file_chunk, 1, sizeof(file_chunk), file_to_send)) > 0) {
-                char encoded_content[BUFFER_SIZE] = {0};
-                encode_content(file_chunk, encoded_content);
-                send(sock, encoded_content, strlen(encoded_content), 0);
+// Read one frame and apply it to its stream. Returns 1 if it finished the
+// stream, 0 if not, -1 if the connection failed.
+int receive_stream_frame(int sock, struct command *commands, int count) {
+    MessageHeader frame;
+    struct command *command = NULL;
+
+    if (protocol_recv(sock, &frame) != 0) {
+        printf("Failed to receive response from server\n");
+        return -1;
+    }
+    for (int i = 0; i < count && command == NULL; i++) {
+        if (commands[i].open && commands[i].request.request_id == frame.request_id) {
+            command = &commands[i];
+        }
+    }
+    if (command == NULL) {
+        printf("Frame for unknown stream %u\n", frame.request_id);
+        return -1;
+    }
+
+    switch (frame.opcode) {
+    case OP_WINDOW:
+        command->window += frame.payload_length;
+        return 0;
+    case OP_DATA:
+        if (command->received == NULL || frame.payload_length > (unsigned long long)command->remaining ||
+            recv_all(sock, command->received + command->received_length, frame.payload_length) != 0) {
+            printf("Server closed the connection\n");
+            return -1;
+        }
+        command->received_length += frame.payload_length;
+        command->remaining -= frame.payload_length;
+        command->consumed += frame.payload_length;
+        if (command->remaining == 0) {
+            print_stream_result(command, STATUS_OK);
+            return 1;
+        }
+        if (command->consumed >= PROTOCOL_WINDOW / 2) {
+            MessageHeader update = {.opcode = OP_WINDOW, .payload_length = command->consumed, .request_id = frame.request_id};
+            command->consumed = 0;
+            if (protocol_send(sock, &update, NULL) != 0) {
+                perror("Send failed");
+                return -1;
             }
+        }
+        return 0;
+    default:
+        // The reply: a resumed upload's stat, an upload's final status, or
+        // the size of what follows
+        if (command->resume && frame.opcode == OP_STAT) {
+            if (start_resumed_upload(sock, command, &frame) != 0) {
+                return -1;
+            }
+            command->remaining = command->request.payload_length;
+            return 0;
+        }
+        if (command->request.opcode == OP_STAT) {
+            command->total = frame.length;
+        }
+        if (frame.status != STATUS_OK || command->request.opcode == OP_UPLOAD || frame.payload_length == 0) {
+            print_stream_result(command, frame.status);
+            return 1;
+        }
+        command->received = malloc(frame.payload_length);
+        if (command->received == NULL) {
+            perror("Allocation failed");
+            return -1;
+        }
+        command->remaining = frame.payload_length;
+        return 0;
+    }
+}
 
-            fclose(file_to_send);
-            printf("File '%s' sent successfully.\n", filepath);
-        } else if (strstr(server_response, "File content: ") != NULL) {
-            printf("%s", server_response); // Print received file content
-            char content[BUFFER_SIZE] = {0};
-
-            // Loop to receive file content in chunks
-            while ((bytes_received = recv(sock, file_content, sizeof(file_content) - 1, 0)) > 0) {
-                file_content[bytes_received] = '\0'; // Null-terminate
-                decode_content(file_content, content);
-                printf("%s", content); // Print decoded content
+// Run every command at once as streams of one multiplexed connection, up to
+// PROTOCOL_MAX_STREAMS open at a time. Uploads take turns sending a frame
+// each and downloads interleave on the way back, so a large transfer does
+// not hold up a small one; results print as streams finish. Returns like
+// run_commands.
+int run_multiplexed(int sock, struct command *commands, int count, int *retry_after) {
+    MessageHeader multiplex = {.opcode = OP_MULTIPLEX};
+    MessageHeader reply;
+    int opened = 0;
+    int finished = 0;
+    int next_upload = 0;
+
+    snprintf(multiplex.id, sizeof(multiplex.id), "%s", commands[0].id);
+    if (protocol_send(sock, &multiplex, NULL) != 0 || protocol_recv(sock, &reply) != 0) {
+        printf("Failed to receive response from server\n");
+        return -1;
+    }
+    if ((*retry_after = busy_retry_after(sock, &reply)) >= 0) {
+        return 1;
+    }
+    if (reply.status != STATUS_OK) {
+        printf("Server response: Failure: %s\n", protocol_status_text(reply.status));
+        return -1;
+    }
+
+    while (finished < count) {
+        while (opened < count && opened - finished < PROTOCOL_MAX_STREAMS) {
+            struct command *command = &commands[opened++];
+            MessageHeader request = command->resume ? stat_request(command) : command->request;
+            if (protocol_send(sock, &request, command->filename) != 0) {
+                perror("Send failed");
+                return -1;
             }
-            printf("\n");
-        } else if (strstr(server_response, "File: ") != NULL) {
-            printf("Files in directory received from server:\n%s\n", server_response);
-        } else if (strstr(server_response, "Failure:") != NULL) {
-            printf("Server response: %s\n", server_response);
-        } else {
-            printf("Unexpected response from server\n");
+            command->open = 1;
+            command->remaining = command->request.opcode == OP_UPLOAD && !command->resume ? (long long)command->request.payload_length : -1;
+            command->window = PROTOCOL_WINDOW;
+        }
+
+        // Next upload in turn with content to send and window to send it in
+        struct command *sending = NULL;
+        for (int i = 0; i < opened && sending == NULL; i++) {
+            struct command *command = &commands[(next_upload + i) % opened];
+            if (command->open && command->request.opcode == OP_UPLOAD && command->remaining > 0 && command->window > 0) {
+                sending = command;
+                next_upload = (next_upload + i + 1) % opened;
+            }
+        }
+
+        struct pollfd ready = {.fd = sock, .events = POLLIN | (sending ? POLLOUT : 0)};
+        if (poll(&ready, 1, -1) < 0) {
+            perror("poll failed");
+            return -1;
+        }
+        if ((ready.revents & POLLOUT) && send_stream_data(sock, sending) != 0) {
+            return -1;
+        }
+        if (ready.revents & (POLLIN | POLLHUP | POLLERR)) {
+            int result = receive_stream_frame(sock, commands, opened);
+            if (result < 0) {
+                return -1;
+            }
+            finished += result;
+        }
+    }
+    return 0;
+}
+
+// One byte range of a segmented transfer and the connection that moves it
+struct segment {
+    struct command *command;
+    struct sockaddr_in *server;
+    long long start, end;       // Range of the encoded content
+    off_t source_offset;        // Where an upload segment's chunks start in the source file
+    int status;                 // Outcome, STATUS_OK once the range is across
+};
+
+// Uploads and downloads with more than one segment run on their own
+int is_segmented(const struct command *command) {
+    int opcode = command->request.opcode;
+    return command->segments > 1 && ((opcode == OP_UPLOAD && !command->resume) || opcode == OP_DOWNLOAD);
+}
+
+// Split an upload's encoded content into up to count segments of about
+// equal size. Chunks are encoded independently, so a segment can start at
+// any chunk boundary and encode from there. Returns the number of segments.
+int plan_upload_segments(struct command *command, struct segment *segments, int count) {
+    char content[BUFFER_SIZE];
+    long long encoded_offset = 0;
+    size_t encoded;
+    int planned = 0;
+
+    rewind(command->file_to_send);
+    while ((encoded = read_encoded_chunk(command->file_to_send, content)) > 0) {
+        encoded_offset += encoded;
+        if (planned + 1 < count && encoded_offset >= (long long)command->total * (planned + 1) / count &&
+            encoded_offset < (long long)command->total) {
+            segments[planned++].end = encoded_offset;
+            segments[planned].start = encoded_offset;
+            segments[planned].source_offset = ftello(command->file_to_send);
+        }
+    }
+    segments[planned].end = encoded_offset;
+    return planned + 1;
+}
+
+// Connect for one segment and send request, backing off while the server is
+// busy. Returns the socket with the reply in *reply, or -1.
+int request_segment(struct segment *segment, const MessageHeader *request, MessageHeader *reply) {
+    for (int attempt = 0;; attempt++) {
+        int retry_after;
+        int sock = connect_to_server(segment->server);
+        if (sock < 0) {
+            return -1;
+        }
+        if (protocol_send(sock, request, segment->command->filename) != 0 || protocol_recv(sock, reply) != 0) {
+            printf("Failed to receive response from server\n");
+            close(sock);
+            return -1;
+        }
+        if ((retry_after = busy_retry_after(sock, reply)) < 0) {
+            if (reply->status != STATUS_BUSY) {
+                return sock;
+            }
+            retry_after = 0; // No room yet for another segmented file
+        }
+        close(sock);
+        if (attempt == MAX_BUSY_RETRIES) {
+            segment->status = STATUS_BUSY;
+            return -1;
+        }
+        backoff(attempt, retry_after);
+    }
+}
+
+// Thread body: send one segment of an upload from its own view of the source
+void *upload_segment(void *arg) {
+    struct segment *segment = (struct segment *)arg;
+    struct command *command = segment->command;
+    MessageHeader request = command->request;
+    MessageHeader reply;
+    char content[BUFFER_SIZE];
+    long long sent = 0;
+    size_t encoded;
+
+    request.opcode = OP_SEGMENT;
+    request.offset = segment->start;
+    request.payload_length = segment->end - segment->start;
+    request.length = command->total;
+
+    FILE *file = fopen(command->filepath, "rb");
+    if (file == NULL || fseeko(file, segment->source_offset, SEEK_SET) != 0) {
+        if (file) {
+            fclose(file);
         }
-    } else if (bytes_received == 0) {
-        printf("Server closed the connection\n");
+        return NULL;
+    }
+    int sock = request_segment(segment, &request, &reply);
+    if (sock >= 0 && reply.status != STATUS_OK) {
+        segment->status = reply.status;
+    } else if (sock >= 0) {
+        // Ready: the chunks of this range, then the status once stored
+        while (sent < segment->end - segment->start && (encoded = read_encoded_chunk(file, content)) > 0 &&
+               sent + (long long)encoded <= segment->end - segment->start && send_all(sock, content, encoded) == 0) {
+            sent += encoded;
+        }
+        if (sent == segment->end - segment->start && protocol_recv(sock, &reply) == 0) {
+            segment->status = reply.status;
+        }
+    }
+    if (sock >= 0) {
+        close(sock);
+    }
+    fclose(file);
+    return NULL;
+}
+
+// Thread body: receive one range of a download into its place in the buffer
+void *download_segment(void *arg) {
+    struct segment *segment = (struct segment *)arg;
+    struct command *command = segment->command;
+    MessageHeader request = command->request;
+    MessageHeader reply;
+
+    request.offset = segment->start;
+    request.length = segment->end - segment->start;
+    int sock = request_segment(segment, &request, &reply);
+    if (sock < 0) {
+        return NULL;
+    }
+    if (reply.status != STATUS_OK) {
+        segment->status = reply.status;
+    } else if (reply.payload_length == (unsigned long long)request.length &&
+               recv_all(sock, command->received + (segment->start - command->offset), request.length) == 0) {
+        segment->status = STATUS_OK;
+    }
+    close(sock);
+    return NULL;
+}
+
+// Transfer command's file as up to command->segments byte ranges, each over
+// a connection of its own, at once. The server puts an upload together once
+// every segment is stored; a download is reassembled here before it is
+// decoded. Returns 0 if every segment made it, -1 otherwise.
+int run_segmented(struct sockaddr_in *server, struct command *command) {
+    struct segment segments[MAX_SEGMENTS];
+    pthread_t threads[MAX_SEGMENTS];
+    int count = command->segments < MAX_SEGMENTS ? command->segments : MAX_SEGMENTS;
+    int status = STATUS_OK;
+
+    memset(segments, 0, sizeof(segments));
+    if (command->request.opcode == OP_UPLOAD) {
+        count = plan_upload_segments(command, segments, count);
     } else {
-        perror("Receive failed");
+        // The range to split ends at the file's size, so ask for it first
+        struct segment probe = {.command = command, .server = server, .status = STATUS_ERROR};
+        MessageHeader request = stat_request(command);
+        MessageHeader reply;
+        int sock = request_segment(&probe, &request, &reply);
+        if (sock < 0) {
+            print_stream_result(command, probe.status);
+            return -1;
+        }
+        close(sock);
+        if (reply.status != STATUS_OK || command->offset > (long long)reply.length) {
+            print_stream_result(command, reply.status != STATUS_OK ? reply.status : STATUS_BAD_RANGE);
+            return -1;
+        }
+
+        long long end = reply.length;
+        if (command->length > 0 && command->length < end - command->offset) {
+            end = command->offset + command->length;
+        }
+        if (count > end - command->offset) {
+            count = end - command->offset; // Every segment needs a byte: length 0 means the rest
+        }
+        command->received = malloc(end - command->offset + 1);
+        if (command->received == NULL) {
+            perror("Allocation failed");
+            return -1;
+        }
+        command->received_length = end - command->offset;
+        for (int i = 0; i < count; i++) {
+            segments[i].start = command->offset + command->received_length * i / count;
+            segments[i].end = command->offset + command->received_length * (i + 1) / count;
+        }
+    }
+
+    printf("Transferring '%s' in %d segments\n", command->filename, count);
+    for (int i = 0; i < count; i++) {
+        segments[i].command = command;
+        segments[i].server = server;
+        segments[i].status = STATUS_ERROR;
+        if (pthread_create(&threads[i], NULL, command->request.opcode == OP_UPLOAD ? upload_segment : download_segment, &segments[i]) != 0) {
+            perror("Could not start a segment");
+            count = i;
+            status = STATUS_ERROR;
+        }
+    }
+    for (int i = 0; i < count; i++) {
+        pthread_join(threads[i], NULL);
+        if (segments[i].status != STATUS_OK) {
+            printf("Segment of bytes %lld-%lld failed: %s\n", segments[i].start, segments[i].end, protocol_status_text(segments[i].status));
+            status = segments[i].status;
+        }
+    }
+    print_stream_result(command, status);
+    return status == STATUS_OK ? 0 : -1;
+}
+
+// Run commands over one connection, backing off while the server reports it
+// is busy and reconnecting for the commands not yet answered. Returns 0 when
+// all are answered, -1 otherwise.
+int run_connection(struct sockaddr_in *server, struct command *commands, int count, int multiplexed) {
+    int result = -1;
+    int answered = 0;
+
+    for (int attempt = 0;; attempt++) {
+        int retry_after;
+        int before = answered;
+        int sock = connect_to_server(server);
+        if (sock < 0) {
+            break;
+        }
+        if (multiplexed) {
+            result = run_multiplexed(sock, commands, count, &retry_after);
+        } else {
+            result = run_commands(sock, commands, count, &answered, &retry_after);
+        }
+        close(sock);
+        if (result != 1) {
+            break;
+        }
+        if (answered > before) {
+            attempt = 0; // Busy again only after progress: start the backoff over
+        }
+        if (attempt == MAX_BUSY_RETRIES) {
+            printf("Server response: Failure: %s\n", protocol_status_text(STATUS_BUSY));
+            break;
+        }
+        backoff(attempt, retry_after);
+    }
+    return result == 0 ? 0 : -1;
+}
+
+// Usage: client2 [-m] [command file]...
+// Every command file is one request; all of them share one connection. With
+// -m they run concurrently as multiplexed streams instead of in order. A
+// command with "segments" above 1 runs on its own, split across that many
+// connections.
+int main(int argc, char *argv[]) {
+    struct sockaddr_in server;
+    const char *default_command = "/home/sana-hashim/Desktop/bscs22101_bscs22017_Group_D_OS-main/command.txt";
+    int multiplexed = 0;
+    int opt;
+    int result = -1;
+
+    while ((opt = getopt(argc, argv, "m")) != -1) {
+        if (opt != 'm') {
+            fprintf(stderr, "Usage: %s [-m] [command file]...\n", argv[0]);
+            return 1;
+        }
+        multiplexed = 1;
+    }
+
+    int count = optind < argc ? argc - optind : 1;
+    struct command *commands = calloc(count, sizeof(struct command));
+    if (commands == NULL) {
+        perror("Allocation failed");
+        return 1;
+    }
+    for (int i = 0; i < count; i++) {
+        if (parse_command_file(optind < argc ? argv[optind + i] : default_command, &commands[i]) != 0 ||
+            prepare_request(&commands[i], i + 1) != 0) {
+            return 1;
+        }
+    }
+
+    // Setup server address structure
+    server.sin_family = AF_INET;
+    server.sin_port = htons(PORT);
+    server.sin_addr.s_addr = inet_addr("127.0.0.1");
+    srand(time(NULL) ^ getpid());
+
+    // Run the commands in order: segmented ones alone, every run of the
+    // others over a shared connection
+    result = 0;
+    for (int first = 0; first < count;) {
+        int last = first + 1;
+        if (is_segmented(&commands[first])) {
+            if (run_segmented(&server, &commands[first]) != 0) {
+                result = -1;
+            }
+        } else {
+            while (last < count && !is_segmented(&commands[last])) {
+                last++;
+            }
+            if (run_connection(&server, commands + first, last - first, multiplexed) != 0) {
+                result = -1;
+            }
+        }
+        first = last;
     }
 
     // Cleanup
-    close(sock);
-    return 0;
+    for (int i = 0; i < count; i++) {
+        if (commands[i].file_to_send) {
+            fclose(commands[i].file_to_send);
+        }
+    }
+    free(commands);
+    return result == 0 ? 0 : 1;
 }
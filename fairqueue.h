@@ -0,0 +1,254 @@
+#ifndef FAIRQUEUE_H
+#define FAIRQUEUE_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+
+// Weighted fair queue keyed by tenant (deficit round-robin, unit cost per
+// item). Every tenant with queued work sits on an active ring; the tenant at
+// the head may take `weight` items per round before it moves to the tail, and
+// never has more than `cap` items in flight. A tenant that floods the queue
+// therefore delays others by at most one round, however much it has queued.
+//
+// Items are intrusive: embed a FairItem in the queued object. Tenants are
+// created on first use and freed once they have nothing queued or in flight,
+// unless fair_configure set them up, so keys taken from clients cannot grow
+// the table without bound; keys longer than FAIR_KEY_SIZE - 1 are truncated.
+
+#define FAIR_BUCKETS 256   // Tenant hash buckets, power of two
+#define FAIR_KEY_SIZE 64   // Longest tenant key, including the terminator
+
+typedef struct FairTenant FairTenant;
+
+typedef struct FairItem {
+    struct FairItem *next;
+    FairTenant *tenant;
+} FairItem;
+
+struct FairTenant {
+    char key[FAIR_KEY_SIZE];
+    int weight;                 // Items per round
+    int cap;                    // Items in flight at most, 0 for the queue default
+    int deficit;                // Items left in this round
+    int in_flight;
+    int active;                 // On the active ring
+    int configured;             // Set by fair_configure, kept while idle
+    FairItem *head;             // Queued items, oldest first
+    FairItem *tail;
+    FairTenant *next_active;
+    FairTenant *next_bucket;
+};
+
+typedef struct {
+    pthread_mutex_t lock;
+    FairTenant *buckets[FAIR_BUCKETS];
+    FairTenant *active_head;
+    FairTenant *active_tail;
+    int active_count;
+    size_t pending;             // Queued items over all tenants
+    int default_weight;
+    int default_cap;
+} FairQueue;
+
+// Function prototypes
+void fair_init(FairQueue *queue, int default_weight, int default_cap);
+int fair_configure(FairQueue *queue, const char *key, int weight, int cap);
+int fair_submit(FairQueue *queue, const char *key, FairItem *item);
+FairItem *fair_next(FairQueue *queue);
+int fair_complete(FairQueue *queue, FairItem *item);
+size_t fair_pending(FairQueue *queue);
+
+
+void fair_init(FairQueue *queue, int default_weight, int default_cap) {
+    memset(queue, 0, sizeof(FairQueue));
+    pthread_mutex_init(&queue->lock, NULL);
+    queue->default_weight = default_weight;
+    queue->default_cap = default_cap;
+}
+
+static FairTenant **fair_bucket(FairQueue *queue, const char *key) {
+    uint32_t hash = 2166136261u; // FNV-1a
+
+    for (const char *p = key; *p; p++) {
+        hash = (hash ^ (unsigned char)*p) * 16777619u;
+    }
+    return &queue->buckets[hash & (FAIR_BUCKETS - 1)];
+}
+
+// Find or create the tenant for key. Call with the lock held.
+static FairTenant *fair_tenant_locked(FairQueue *queue, const char *key) {
+    char truncated[FAIR_KEY_SIZE];
+
+    // Hashed and matched as stored, so a long key always finds its tenant
+    // and fair_release_locked looks in the same bucket
+    snprintf(truncated, sizeof(truncated), "%s", key);
+    FairTenant **bucket = fair_bucket(queue, truncated);
+    for (FairTenant *tenant = *bucket; tenant; tenant = tenant->next_bucket) {
+        if (strcmp(tenant->key, truncated) == 0) {
+            return tenant;
+        }
+    }
+
+    FairTenant *tenant = calloc(1, sizeof(FairTenant));
+    if (!tenant) {
+        return NULL;
+    }
+    memcpy(tenant->key, truncated, sizeof(tenant->key));
+    tenant->weight = queue->default_weight;
+    tenant->next_bucket = *bucket;
+    *bucket = tenant;
+    return tenant;
+}
+
+// Free tenant if nothing keeps it: no queued or in-flight items and no
+// configuration. Call with the lock held.
+static void fair_release_locked(FairQueue *queue, FairTenant *tenant) {
+    if (tenant->active || tenant->head || tenant->in_flight > 0 || tenant->configured) {
+        return;
+    }
+    for (FairTenant **link = fair_bucket(queue, tenant->key); *link; link = &(*link)->next_bucket) {
+        if (*link == tenant) {
+            *link = tenant->next_bucket;
+            free(tenant);
+            return;
+        }
+    }
+}
+
+static int fair_at_cap(FairQueue *queue, FairTenant *tenant) {
+    return tenant->in_flight >= (tenant->cap ? tenant->cap : queue->default_cap);
+}
+
+static void fair_activate_locked(FairQueue *queue, FairTenant *tenant) {
+    tenant->active = 1;
+    tenant->deficit = tenant->weight; // Fresh quantum for its next round
+    tenant->next_active = NULL;
+    if (queue->active_tail) {
+        queue->active_tail->next_active = tenant;
+    } else {
+        queue->active_head = tenant;
+    }
+    queue->active_tail = tenant;
+    queue->active_count++;
+}
+
+// Pop the head tenant off the active ring
+static FairTenant *fair_pop_active_locked(FairQueue *queue) {
+    FairTenant *tenant = queue->active_head;
+
+    queue->active_head = tenant->next_active;
+    if (!queue->active_head) {
+        queue->active_tail = NULL;
+    }
+    tenant->next_active = NULL;
+    queue->active_count--;
+    return tenant;
+}
+
+// Set the weight and in-flight cap of key; a cap of 0 follows the queue
+// default. Returns 0 on success, -1 on failure.
+int fair_configure(FairQueue *queue, const char *key, int weight, int cap) {
+    if (weight < 1 || cap < 0 || strlen(key) >= FAIR_KEY_SIZE) {
+        return -1;
+    }
+    pthread_mutex_lock(&queue->lock);
+    FairTenant *tenant = fair_tenant_locked(queue, key);
+    if (tenant) {
+        tenant->weight = weight;
+        tenant->cap = cap;
+        tenant->configured = 1;
+    }
+    pthread_mutex_unlock(&queue->lock);
+    return tenant ? 0 : -1;
+}
+
+// Queue item for tenant key. Returns 0 on success, -1 if the tenant could not
+// be created.
+int fair_submit(FairQueue *queue, const char *key, FairItem *item) {
+    pthread_mutex_lock(&queue->lock);
+    FairTenant *tenant = fair_tenant_locked(queue, key);
+    if (!tenant) {
+        pthread_mutex_unlock(&queue->lock);
+        return -1;
+    }
+
+    item->next = NULL;
+    item->tenant = tenant;
+    if (tenant->tail) {
+        tenant->tail->next = item;
+    } else {
+        tenant->head = item;
+    }
+    tenant->tail = item;
+    queue->pending++;
+    if (!tenant->active) {
+        fair_activate_locked(queue, tenant);
+    }
+    pthread_mutex_unlock(&queue->lock);
+    return 0;
+}
+
+// Next item in fair order, counted in flight until fair_complete. NULL if
+// nothing is queued or every tenant with queued work is at its cap.
+FairItem *fair_next(FairQueue *queue) {
+    FairItem *item = NULL;
+    int capped = 0;
+
+    pthread_mutex_lock(&queue->lock);
+    while (queue->active_head && capped < queue->active_count) {
+        FairTenant *tenant = queue->active_head;
+
+        if (!fair_at_cap(queue, tenant) && tenant->deficit > 0) {
+            item = tenant->head;
+            tenant->head = item->next;
+            if (!tenant->head) {
+                tenant->tail = NULL;
+            }
+            item->next = NULL;
+            tenant->deficit--;
+            tenant->in_flight++;
+            queue->pending--;
+            if (!tenant->head) {
+                // Out of work: leave the ring and forfeit the rest of the round
+                fair_pop_active_locked(queue);
+                tenant->active = 0;
+                tenant->deficit = 0;
+            }
+            break;
+        }
+
+        // Round over for this tenant (quantum spent, or at its cap): back
+        // of the ring with a fresh quantum
+        capped = fair_at_cap(queue, tenant) ? capped + 1 : 0;
+        fair_pop_active_locked(queue);
+        fair_activate_locked(queue, tenant);
+    }
+    pthread_mutex_unlock(&queue->lock);
+    return item;
+}
+
+// Mark item finished. Returns 1 if its tenant still has queued work, which
+// the freed slot may unblock, so the caller should dispatch again.
+int fair_complete(FairQueue *queue, FairItem *item) {
+    FairTenant *tenant = item->tenant;
+
+    pthread_mutex_lock(&queue->lock);
+    tenant->in_flight--;
+    int waiting = tenant->head != NULL;
+    fair_release_locked(queue, tenant);
+    pthread_mutex_unlock(&queue->lock);
+    return waiting;
+}
+
+// Number of queued items
+size_t fair_pending(FairQueue *queue) {
+    pthread_mutex_lock(&queue->lock);
+    size_t pending = queue->pending;
+    pthread_mutex_unlock(&queue->lock);
+    return pending;
+}
+
+#endif // FAIRQUEUE_H
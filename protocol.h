@@ -0,0 +1,268 @@
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <endian.h>
+#include <sys/socket.h>
+
+// Wire protocol shared by the server and client2. Every message starts with
+// a fixed header in network byte order:
+//
+//   offset  size  field
+//        0     4  magic, PROTOCOL_MAGIC
+//        4     1  opcode (enum protocol_opcode)
+//        5     1  status (enum protocol_status), 0 in requests
+//        6     2  name length, bytes of file name following the header
+//        8    16  client ID, NUL padded
+//       24     8  payload length, bytes following the name
+//       32     4  request ID, chosen by the client and echoed in replies
+//       36     8  offset, first byte of the file a request covers, echoed
+//       44     8  length, bytes a download asks for (0: all from offset);
+//                 in replies, the full size of the file
+//
+// A request is a header, its file name and, for uploads, the file content.
+// The server answers with a header carrying the same opcode, request ID and
+// offset and a status:
+//
+//   upload    -> OK (ready), the client sends payload length bytes,
+//                then a final OK or ERROR once they are stored
+//   download  -> OK with the size of the range as payload length, then
+//                the content
+//   view      -> OK with the listing as payload
+//   stat      -> OK with the file's size, no payload
+//   segment   -> as upload
+//
+// An upload with a non-zero offset resumes a partial file: the bytes before
+// the offset are kept, the content is written from there on and the file
+// ends where it ends. An interrupted upload leaves the file cut after the
+// last byte stored, so a stat tells the client where to resume. Offsets past
+// the end of the file are refused with BAD_RANGE.
+//
+// A large file can be uploaded as segments over parallel connections: each
+// SEGMENT request carries the range from offset as its payload and the size
+// of the whole file as length. The server writes the segments into a staging
+// file preallocated to that size and puts it in place under its name once
+// they cover all of it; until then the file keeps its old content. A
+// segmented download is a set of ranged downloads.
+//
+// Any other status ends the request. A busy server answers before reading
+// the request, with opcode NONE and the retry hint in milliseconds as a
+// 4-byte payload.
+//
+// Connections are persistent: after a reply the server reads the next
+// request from the same connection, until the client closes it. Requests may
+// be pipelined, sent before earlier replies arrive; they are served and
+// answered in order. An upload's content waits for its ready reply, so a
+// pipeline pauses at each upload. The server closes the connection after a
+// malformed header or a failed transfer, where the byte stream can no
+// longer be trusted.
+//
+// A MULTIPLEX request (answered OK) switches the connection to frames, so
+// several requests can run at once. Each request opens a stream named by its
+// request ID, at most PROTOCOL_MAX_STREAMS at a time. Only DATA frames carry
+// bytes after the header (payload length of them, at most
+// PROTOCOL_FRAME_MAX); content that would follow a request or reply travels
+// in DATA frames of its stream instead, and the header's payload length
+// gives its total. A sender may only have as many DATA bytes outstanding per
+// stream as the receiver's window: PROTOCOL_WINDOW to start with, raised by
+// WINDOW frames whose payload length is the increment.
+//
+//   upload    -> client sends DATA right away; the server answers once, with
+//                the final status (or early, with a failure)
+//   segment   -> as upload
+//   download  -> OK with the file size, then DATA
+//   view      -> OK with the listing's size, then DATA
+//
+// Frames of different streams interleave freely. Opening too many streams,
+// reusing a live request ID or overrunning a window closes the connection.
+
+#define PROTOCOL_MAGIC 0x4F534632u // "OSF2"
+#define PROTOCOL_HEADER_SIZE 52
+#define PROTOCOL_ID_SIZE 16        // ID field, at most 15 characters
+#define PROTOCOL_NAME_MAX 255      // Longest file name
+#define PROTOCOL_MAX_STREAMS 16    // Streams open at once on a multiplexed connection
+#define PROTOCOL_FRAME_MAX (16 * 1024) // Largest DATA frame payload
+#define PROTOCOL_WINDOW (256 * 1024)   // Initial window of each stream and direction
+
+enum protocol_opcode {
+    OP_NONE = 0,
+    OP_UPLOAD = 1,
+    OP_DOWNLOAD = 2,
+    OP_VIEW = 3,
+    OP_MULTIPLEX = 4, // Switch the connection to frames
+    OP_DATA = 5,      // Content of a stream
+    OP_WINDOW = 6,    // Let the peer send more of a stream
+    OP_STAT = 7,      // Size of a file, partial uploads included
+    OP_SEGMENT = 8    // One range of a file uploaded in parallel segments
+};
+
+enum protocol_status {
+    STATUS_OK = 0,
+    STATUS_BAD_REQUEST = 1, // Malformed header, unknown opcode or bad name
+    STATUS_NOT_FOUND = 2,
+    STATUS_NO_SPACE = 3,
+    STATUS_BUSY = 4,        // Retry after the hinted delay
+    STATUS_ERROR = 5,       // Server-side failure
+    STATUS_BAD_RANGE = 6    // Offset past the end of the file
+};
+
+typedef struct {
+    uint8_t opcode;
+    uint8_t status;
+    uint16_t name_length;
+    char id[PROTOCOL_ID_SIZE];  // Always NUL terminated once decoded
+    uint64_t payload_length;
+    uint32_t request_id;
+    uint64_t offset;
+    uint64_t length;
+} MessageHeader;
+
+// Function prototypes
+void protocol_encode(const MessageHeader *header, unsigned char *wire);
+int protocol_decode(const unsigned char *wire, MessageHeader *header);
+int send_all(int sock, const void *data, size_t length);
+int recv_all(int sock, void *data, size_t length);
+int protocol_send(int sock, const MessageHeader *header, const char *name);
+int protocol_recv(int sock, MessageHeader *header);
+const char *protocol_status_text(int status);
+
+
+// Serialize header into PROTOCOL_HEADER_SIZE bytes at wire
+void protocol_encode(const MessageHeader *header, unsigned char *wire) {
+    uint32_t magic = htobe32(PROTOCOL_MAGIC);
+    uint16_t name_length = htobe16(header->name_length);
+    uint64_t payload_length = htobe64(header->payload_length);
+    uint32_t request_id = htobe32(header->request_id);
+    uint64_t offset = htobe64(header->offset);
+    uint64_t length = htobe64(header->length);
+
+    memcpy(wire, &magic, 4);
+    wire[4] = header->opcode;
+    wire[5] = header->status;
+    memcpy(wire + 6, &name_length, 2);
+    memset(wire + 8, 0, PROTOCOL_ID_SIZE);
+    memcpy(wire + 8, header->id, strnlen(header->id, PROTOCOL_ID_SIZE - 1));
+    memcpy(wire + 24, &payload_length, 8);
+    memcpy(wire + 32, &request_id, 4);
+    memcpy(wire + 36, &offset, 8);
+    memcpy(wire + 44, &length, 8);
+}
+
+// Parse PROTOCOL_HEADER_SIZE bytes. Returns -1 if they are not a header.
+int protocol_decode(const unsigned char *wire, MessageHeader *header) {
+    uint32_t magic;
+    uint16_t name_length;
+    uint64_t payload_length;
+    uint32_t request_id;
+    uint64_t offset;
+    uint64_t length;
+
+    memcpy(&magic, wire, 4);
+    if (be32toh(magic) != PROTOCOL_MAGIC) {
+        return -1;
+    }
+    memcpy(&name_length, wire + 6, 2);
+    memcpy(&payload_length, wire + 24, 8);
+    memcpy(&request_id, wire + 32, 4);
+    memcpy(&offset, wire + 36, 8);
+    memcpy(&length, wire + 44, 8);
+    header->opcode = wire[4];
+    header->status = wire[5];
+    header->name_length = be16toh(name_length);
+    memcpy(header->id, wire + 8, PROTOCOL_ID_SIZE);
+    header->id[PROTOCOL_ID_SIZE - 1] = '\0';
+    header->payload_length = be64toh(payload_length);
+    header->request_id = be32toh(request_id);
+    header->offset = be64toh(offset);
+    header->length = be64toh(length);
+    return 0;
+}
+
+// Returns 0 once every byte is sent, -1 on error
+int send_all(int sock, const void *data, size_t length) {
+    const char *p = (const char *)data;
+
+    while (length > 0) {
+        ssize_t sent = send(sock, p, length, MSG_NOSIGNAL);
+        if (sent < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        p += sent;
+        length -= sent;
+    }
+    return 0;
+}
+
+// Returns 0 once length bytes are read, -1 on error or if the peer closed first
+int recv_all(int sock, void *data, size_t length) {
+    char *p = (char *)data;
+
+    while (length > 0) {
+        ssize_t received = recv(sock, p, length, 0);
+        if (received < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        if (received == 0) {
+            return -1;
+        }
+        p += received;
+        length -= received;
+    }
+    return 0;
+}
+
+// Send a header and its name_length bytes of name (may be NULL when 0) as
+// one write. Returns 0 on success, -1 on error.
+int protocol_send(int sock, const MessageHeader *header, const char *name) {
+    unsigned char wire[PROTOCOL_HEADER_SIZE + PROTOCOL_NAME_MAX];
+
+    if (header->name_length > PROTOCOL_NAME_MAX) {
+        return -1;
+    }
+    protocol_encode(header, wire);
+    if (name != NULL && header->name_length > 0) {
+        memcpy(wire + PROTOCOL_HEADER_SIZE, name, header->name_length);
+    }
+    return send_all(sock, wire, PROTOCOL_HEADER_SIZE + header->name_length);
+}
+
+// Read one header. Returns 0 on success, 1 if the peer closed the
+// connection cleanly before a header started, -1 on error, a header cut
+// short or a bad magic.
+int protocol_recv(int sock, MessageHeader *header) {
+    unsigned char wire[PROTOCOL_HEADER_SIZE];
+    ssize_t received;
+
+    while ((received = recv(sock, wire, sizeof(wire), 0)) < 0 && errno == EINTR) {
+        // Interrupted by a signal, read again
+    }
+    if (received <= 0) {
+        return received == 0 ? 1 : -1;
+    }
+    if (recv_all(sock, wire + received, sizeof(wire) - received) != 0) {
+        return -1;
+    }
+    return protocol_decode(wire, header);
+}
+
+const char *protocol_status_text(int status) {
+    switch (status) {
+    case STATUS_OK: return "OK";
+    case STATUS_BAD_REQUEST: return "Bad request";
+    case STATUS_NOT_FOUND: return "File not found";
+    case STATUS_NO_SPACE: return "Not enough disk space";
+    case STATUS_BUSY: return "Busy";
+    case STATUS_ERROR: return "Server error";
+    case STATUS_BAD_RANGE: return "Offset past the end of the file";
+    default: return "Unknown status";
+    }
+}
+
+#endif // PROTOCOL_H
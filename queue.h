@@ -0,0 +1,205 @@
+#ifndef QUEUE_H
+#define QUEUE_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <sched.h>
+
+// Bounded multi-producer/multi-consumer ring. Every cell carries a sequence
+// number that tells producers and consumers whether it is theirs to fill or
+// drain, so pushes and pops are a single CAS on a position counter with no
+// lock. Items are non-NULL pointers owned by the caller; the queue stores
+// them as is.
+//
+// A blocking queue adds two counting semaphores (free slots and queued
+// items): enqueue waits for room instead of failing, which pushes back on
+// producers, and dequeue waits for work.
+
+typedef struct {
+    _Atomic size_t sequence; // Position this cell is ready for
+    void *data;              // Queued item
+} QueueCell;
+
+typedef struct {
+    QueueCell *cells;                    // Ring storage, capacity is a power of two
+    size_t mask;                         // capacity - 1
+    int blocking;                        // Use slots/items to wait instead of failing
+    _Alignas(64) _Atomic size_t enqueue_pos;
+    _Alignas(64) _Atomic size_t dequeue_pos;
+    sem_t slots;                         // Free cells (blocking queues only)
+    sem_t items;                         // Queued items (blocking queues only)
+} Queue;
+
+// Function prototypes
+int init_queue(Queue *queue, size_t capacity, int blocking);
+void destroy_queue(Queue *queue);
+int try_enqueue(Queue *queue, void *item);
+void *try_dequeue(Queue *queue);
+void enqueue(Queue *queue, void *item);
+void *dequeue(Queue *queue);
+size_t queue_depth(Queue *queue);
+
+
+// Capacity is rounded up to a power of two. Returns 0 on success, -1 on failure.
+int init_queue(Queue *queue, size_t capacity, int blocking) {
+    size_t size = 2;
+    while (size < capacity) {
+        size <<= 1;
+    }
+
+    queue->cells = calloc(size, sizeof(QueueCell));
+    if (!queue->cells) {
+        return -1;
+    }
+    for (size_t i = 0; i < size; i++) {
+        atomic_init(&queue->cells[i].sequence, i);
+    }
+    queue->mask = size - 1;
+    queue->blocking = blocking;
+    atomic_init(&queue->enqueue_pos, 0);
+    atomic_init(&queue->dequeue_pos, 0);
+    if (blocking) {
+        sem_init(&queue->slots, 0, (unsigned int)size);
+        sem_init(&queue->items, 0, 0);
+    }
+    return 0;
+}
+
+void destroy_queue(Queue *queue) {
+    if (queue->blocking) {
+        sem_destroy(&queue->slots);
+        sem_destroy(&queue->items);
+    }
+    free(queue->cells);
+    queue->cells = NULL;
+}
+
+// Lock-free push onto the ring, -1 if it is full
+static int ring_push(Queue *queue, void *item) {
+    size_t pos = atomic_load_explicit(&queue->enqueue_pos, memory_order_relaxed);
+
+    while (1) {
+        QueueCell *cell = &queue->cells[pos & queue->mask];
+        size_t sequence = atomic_load_explicit(&cell->sequence, memory_order_acquire);
+        intptr_t diff = (intptr_t)sequence - (intptr_t)pos;
+
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&queue->enqueue_pos, &pos, pos + 1,
+                                                      memory_order_relaxed, memory_order_relaxed)) {
+                cell->data = item;
+                atomic_store_explicit(&cell->sequence, pos + 1, memory_order_release);
+                return 0;
+            }
+        } else if (diff < 0) {
+            return -1; // The cell still holds an item from the previous lap
+        } else {
+            pos = atomic_load_explicit(&queue->enqueue_pos, memory_order_relaxed);
+        }
+    }
+}
+
+// Lock-free pop from the ring, NULL if it is empty
+static void *ring_pop(Queue *queue) {
+    size_t pos = atomic_load_explicit(&queue->dequeue_pos, memory_order_relaxed);
+
+    while (1) {
+        QueueCell *cell = &queue->cells[pos & queue->mask];
+        size_t sequence = atomic_load_explicit(&cell->sequence, memory_order_acquire);
+        intptr_t diff = (intptr_t)sequence - (intptr_t)(pos + 1);
+
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&queue->dequeue_pos, &pos, pos + 1,
+                                                      memory_order_relaxed, memory_order_relaxed)) {
+                void *item = cell->data;
+                atomic_store_explicit(&cell->sequence, pos + queue->mask + 1, memory_order_release);
+                return item;
+            }
+        } else if (diff < 0) {
+            return NULL; // Nothing published in this cell yet
+        } else {
+            pos = atomic_load_explicit(&queue->dequeue_pos, memory_order_relaxed);
+        }
+    }
+}
+
+// Returns 0 on success, -1 if the queue is full and the item was not queued
+int try_enqueue(Queue *queue, void *item) {
+    if (!queue->blocking) {
+        return ring_push(queue, item);
+    }
+    if (sem_trywait(&queue->slots) != 0) {
+        return -1;
+    }
+    // A slot is reserved, but the cell at our position may still be draining
+    while (ring_push(queue, item) != 0) {
+        sched_yield();
+    }
+    sem_post(&queue->items);
+    return 0;
+}
+
+// Returns the oldest item, or NULL if the queue is empty
+void *try_dequeue(Queue *queue) {
+    if (!queue->blocking) {
+        return ring_pop(queue);
+    }
+    if (sem_trywait(&queue->items) != 0) {
+        return NULL;
+    }
+    void *item;
+    while ((item = ring_pop(queue)) == NULL) {
+        sched_yield(); // An item is counted, its producer is still publishing it
+    }
+    sem_post(&queue->slots);
+    return item;
+}
+
+// Blocking queues wait for a free slot; non-blocking queues spin until one opens
+void enqueue(Queue *queue, void *item) {
+    if (queue->blocking) {
+        while (sem_wait(&queue->slots) != 0) {
+            // Interrupted by a signal, wait again
+        }
+        while (ring_push(queue, item) != 0) {
+            sched_yield();
+        }
+        sem_post(&queue->items);
+        return;
+    }
+    while (ring_push(queue, item) != 0) {
+        sched_yield();
+    }
+}
+
+// Blocking queues wait for an item; non-blocking queues spin until one arrives
+void *dequeue(Queue *queue) {
+    void *item;
+
+    if (queue->blocking) {
+        while (sem_wait(&queue->items) != 0) {
+            // Interrupted by a signal, wait again
+        }
+        while ((item = ring_pop(queue)) == NULL) {
+            sched_yield();
+        }
+        sem_post(&queue->slots);
+        return item;
+    }
+    while ((item = ring_pop(queue)) == NULL) {
+        sched_yield();
+    }
+    return item;
+}
+
+// Approximate number of queued items
+size_t queue_depth(Queue *queue) {
+    size_t tail = atomic_load_explicit(&queue->enqueue_pos, memory_order_relaxed);
+    size_t head = atomic_load_explicit(&queue->dequeue_pos, memory_order_relaxed);
+    return tail > head ? tail - head : 0;
+}
+
+#endif // QUEUE_H
@@ -0,0 +1,231 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "queue.h"
+#include "scheduler.h"
+
+// Microbenchmark for the lock-free ring in queue.h against the mutex and
+// semaphore queue it replaced (kept below as LegacyQueue).
+//
+//   ./queuebench [-n items per producer] [-c capacity] [-t max threads]
+//
+// For 1..max threads it runs that many producers and as many consumers and
+// reports items moved per second for the legacy queue, the ring in blocking
+// mode (semaphores for backpressure), the ring alone with spinning callers and
+// the work-stealing scheduler in scheduler.h (consumers are its workers).
+
+#define DEFAULT_ITEMS 1000000
+#define DEFAULT_CAPACITY 256
+#define DEFAULT_MAX_THREADS 8
+#define STOP_ITEM ((void *)-1)
+
+// The previous queue: a fixed ring guarded by one mutex, counted by a semaphore
+typedef struct {
+    void **data;
+    int capacity;
+    int front;
+    int rear;
+    int count;
+    pthread_mutex_t mutex;
+    sem_t sem;
+} LegacyQueue;
+
+static void legacy_init(LegacyQueue *queue, int capacity) {
+    queue->data = calloc(capacity, sizeof(void *));
+    queue->capacity = capacity;
+    queue->front = 0;
+    queue->rear = -1;
+    queue->count = 0;
+    pthread_mutex_init(&queue->mutex, NULL);
+    sem_init(&queue->sem, 0, 0);
+}
+
+static void legacy_destroy(LegacyQueue *queue) {
+    pthread_mutex_destroy(&queue->mutex);
+    sem_destroy(&queue->sem);
+    free(queue->data);
+}
+
+static int legacy_enqueue(LegacyQueue *queue, void *item) {
+    int result = -1;
+    pthread_mutex_lock(&queue->mutex);
+    if (queue->count < queue->capacity) {
+        queue->rear = (queue->rear + 1) % queue->capacity;
+        queue->data[queue->rear] = item;
+        queue->count++;
+        sem_post(&queue->sem);
+        result = 0;
+    }
+    pthread_mutex_unlock(&queue->mutex);
+    return result;
+}
+
+static void *legacy_dequeue(LegacyQueue *queue) {
+    sem_wait(&queue->sem);
+    pthread_mutex_lock(&queue->mutex);
+    void *item = queue->data[queue->front];
+    queue->front = (queue->front + 1) % queue->capacity;
+    queue->count--;
+    pthread_mutex_unlock(&queue->mutex);
+    return item;
+}
+
+typedef struct {
+    int legacy;
+    LegacyQueue *legacy_queue;
+    Queue *queue;
+    long items;
+} BenchArgs;
+
+static void *producer(void *arg) {
+    BenchArgs *args = (BenchArgs *)arg;
+
+    for (long i = 1; i <= args->items; i++) {
+        void *item = (void *)(uintptr_t)i;
+        if (args->legacy) {
+            // The old queue dropped work when full; retrying is the fair comparison
+            while (legacy_enqueue(args->legacy_queue, item) != 0) {
+                sched_yield();
+            }
+        } else {
+            enqueue(args->queue, item);
+        }
+    }
+    return NULL;
+}
+
+static void *consumer(void *arg) {
+    BenchArgs *args = (BenchArgs *)arg;
+
+    while (1) {
+        void *item = args->legacy ? legacy_dequeue(args->legacy_queue) : dequeue(args->queue);
+        if (item == STOP_ITEM) break;
+    }
+    return NULL;
+}
+
+static double run(int legacy, int blocking, int threads, long items, int capacity) {
+    LegacyQueue legacy_queue;
+    Queue queue;
+    if (legacy) {
+        legacy_init(&legacy_queue, capacity);
+    } else if (init_queue(&queue, capacity, blocking) != 0) {
+        fprintf(stderr, "Failed to allocate queue\n");
+        exit(EXIT_FAILURE);
+    }
+
+    BenchArgs args = {legacy, &legacy_queue, &queue, items};
+    pthread_t producers[threads], consumers[threads];
+    struct timespec start, end;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < threads; i++) {
+        pthread_create(&consumers[i], NULL, consumer, &args);
+        pthread_create(&producers[i], NULL, producer, &args);
+    }
+    for (int i = 0; i < threads; i++) {
+        pthread_join(producers[i], NULL);
+    }
+    for (int i = 0; i < threads; i++) {
+        if (legacy) {
+            while (legacy_enqueue(&legacy_queue, STOP_ITEM) != 0) sched_yield();
+        } else {
+            enqueue(&queue, STOP_ITEM);
+        }
+    }
+    for (int i = 0; i < threads; i++) {
+        pthread_join(consumers[i], NULL);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    if (legacy) {
+        legacy_destroy(&legacy_queue);
+    } else {
+        destroy_queue(&queue);
+    }
+
+    double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    return threads * items / seconds;
+}
+
+static _Atomic long scheduler_done;
+static Scheduler bench_scheduler;
+
+static void count_item(void *item) {
+    (void)item;
+    atomic_fetch_add_explicit(&scheduler_done, 1, memory_order_relaxed);
+}
+
+static void *scheduler_producer(void *arg) {
+    long items = *(long *)arg;
+
+    for (long i = 1; i <= items; i++) {
+        scheduler_submit(&bench_scheduler, (void *)(uintptr_t)i);
+    }
+    return NULL;
+}
+
+static double run_scheduler(int threads, long items) {
+    pthread_t producers[threads];
+    struct timespec start, end;
+
+    atomic_store(&scheduler_done, 0);
+    if (scheduler_start(&bench_scheduler, threads, 0, 0, count_item, NULL) != 0) {
+        fprintf(stderr, "Failed to start scheduler\n");
+        exit(EXIT_FAILURE);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < threads; i++) {
+        pthread_create(&producers[i], NULL, scheduler_producer, &items);
+    }
+    for (int i = 0; i < threads; i++) {
+        pthread_join(producers[i], NULL);
+    }
+    while (atomic_load(&scheduler_done) < threads * items) {
+        sched_yield();
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    scheduler_stop(&bench_scheduler);
+
+    double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    return threads * items / seconds;
+}
+
+int main(int argc, char *argv[]) {
+    long items = DEFAULT_ITEMS;
+    int capacity = DEFAULT_CAPACITY;
+    int max_threads = DEFAULT_MAX_THREADS;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:c:t:")) != -1) {
+        switch (opt) {
+        case 'n': items = atol(optarg); break;
+        case 'c': capacity = atoi(optarg); break;
+        case 't': max_threads = atoi(optarg); break;
+        default:
+            fprintf(stderr, "Usage: %s [-n items per producer] [-c capacity] [-t max threads]\n", argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    if (items < 1 || capacity < 2 || max_threads < 1) {
+        fprintf(stderr, "items, capacity and threads must be positive\n");
+        return EXIT_FAILURE;
+    }
+
+    printf("%-8s %14s %16s %16s %14s\n", "threads", "legacy (M/s)", "ring block (M/s)", "ring spin (M/s)", "sched (M/s)");
+    for (int threads = 1; threads <= max_threads; threads *= 2) {
+        double legacy = run(1, 1, threads, items, capacity);
+        double blocking = run(0, 1, threads, items, capacity);
+        double spinning = run(0, 0, threads, items, capacity);
+        double stealing = run_scheduler(threads, items);
+        printf("%-8d %14.2f %16.2f %16.2f %14.2f\n", threads, legacy / 1e6, blocking / 1e6, spinning / 1e6, stealing / 1e6);
+    }
+    return EXIT_SUCCESS;
+}
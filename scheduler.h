@@ -0,0 +1,331 @@
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <sched.h>
+
+#include "queue.h"
+
+// Work-stealing scheduler. Every worker owns a Chase-Lev deque: it pushes and
+// pops at the bottom without contention, while idle workers steal from the
+// top. Work from outside the pool (the accept loop) is spread round-robin over
+// per-worker inboxes, lock-free rings that the owner drains into its deque and
+// that idle workers may also steal from, so no single queue is shared by every
+// thread. Workers with nothing to run or steal park on a semaphore.
+//
+// Pinning workers to CPUs needs _GNU_SOURCE defined before the first include.
+
+#define DEQUE_CAPACITY 1024    // Slots per worker deque, power of two
+#define INBOX_CAPACITY 256     // Slots per worker inbox
+#define INBOX_BATCH 8          // Inbox items moved into the deque per refill
+
+// Chase-Lev deque with a fixed ring (Le et al., "Correct and Efficient
+// Work-Stealing for Weak Memory Models")
+typedef struct {
+    _Alignas(64) _Atomic long top;     // Thieves take from here
+    _Alignas(64) _Atomic long bottom;  // The owner pushes and pops here
+    void *_Atomic *slots;
+    long mask;
+} WorkDeque;
+
+typedef struct Scheduler Scheduler;
+
+typedef struct {
+    WorkDeque deque;
+    Queue inbox;             // Submissions from outside the pool
+    void *next;              // Item to run first, when neither deque nor inbox had room for it
+    Scheduler *scheduler;
+    pthread_t thread;
+    int id;
+} Worker;
+
+struct Scheduler {
+    Worker *workers;
+    int count;
+    int pin;                                // Pin worker i to CPU i modulo the CPU count
+    void (*handler)(void *item);            // Runs one work item
+    void (*worker_init)(int worker);        // Called once on each worker thread, may be NULL
+    _Atomic unsigned next_inbox;            // Round-robin cursor for scheduler_submit
+    _Atomic int sleepers;                   // Workers parked or about to park
+    _Atomic int stopping;
+    sem_t wakeup;
+};
+
+// Function prototypes
+int deque_init(WorkDeque *deque, size_t capacity);
+void deque_destroy(WorkDeque *deque);
+int deque_push(WorkDeque *deque, void *item);
+void *deque_pop(WorkDeque *deque);
+void *deque_steal(WorkDeque *deque);
+int scheduler_start(Scheduler *scheduler, int workers, size_t stack_size, int pin,
+                    void (*handler)(void *item), void (*worker_init)(int worker));
+void scheduler_submit(Scheduler *scheduler, void *item);
+void scheduler_stop(Scheduler *scheduler);
+size_t scheduler_pending(Scheduler *scheduler);
+
+
+// Capacity is rounded up to a power of two. Returns 0 on success, -1 on failure.
+int deque_init(WorkDeque *deque, size_t capacity) {
+    size_t size = 2;
+    while (size < capacity) {
+        size <<= 1;
+    }
+
+    deque->slots = calloc(size, sizeof(void *));
+    if (!deque->slots) {
+        return -1;
+    }
+    deque->mask = (long)size - 1;
+    atomic_init(&deque->top, 0);
+    atomic_init(&deque->bottom, 0);
+    return 0;
+}
+
+void deque_destroy(WorkDeque *deque) {
+    free((void *)deque->slots);
+    deque->slots = NULL;
+}
+
+// Owner only. Returns -1 if the deque is full.
+int deque_push(WorkDeque *deque, void *item) {
+    long bottom = atomic_load_explicit(&deque->bottom, memory_order_relaxed);
+    long top = atomic_load_explicit(&deque->top, memory_order_acquire);
+
+    if (bottom - top > deque->mask) {
+        return -1;
+    }
+    atomic_store_explicit(&deque->slots[bottom & deque->mask], item, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_relaxed);
+    return 0;
+}
+
+// Owner only. Newest item, or NULL if the deque is empty.
+void *deque_pop(WorkDeque *deque) {
+    long bottom = atomic_load_explicit(&deque->bottom, memory_order_relaxed) - 1;
+    atomic_store_explicit(&deque->bottom, bottom, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    long top = atomic_load_explicit(&deque->top, memory_order_relaxed);
+
+    if (top > bottom) {
+        atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_relaxed);
+        return NULL;
+    }
+    void *item = atomic_load_explicit(&deque->slots[bottom & deque->mask], memory_order_relaxed);
+    if (top == bottom) {
+        // Last item: race the thieves for it
+        if (!atomic_compare_exchange_strong_explicit(&deque->top, &top, top + 1,
+                                                     memory_order_seq_cst, memory_order_relaxed)) {
+            item = NULL;
+        }
+        atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_relaxed);
+    }
+    return item;
+}
+
+// Any thread. Oldest item, or NULL if the deque is empty or another thief won.
+void *deque_steal(WorkDeque *deque) {
+    long top = atomic_load_explicit(&deque->top, memory_order_acquire);
+    atomic_thread_fence(memory_order_seq_cst);
+    long bottom = atomic_load_explicit(&deque->bottom, memory_order_acquire);
+
+    if (top >= bottom) {
+        return NULL;
+    }
+    void *item = atomic_load_explicit(&deque->slots[top & deque->mask], memory_order_relaxed);
+    if (!atomic_compare_exchange_strong_explicit(&deque->top, &top, top + 1,
+                                                 memory_order_seq_cst, memory_order_relaxed)) {
+        return NULL;
+    }
+    return item;
+}
+
+// Next item for worker: its own deque, then its inbox, then the other workers
+static void *scheduler_find_work(Worker *worker) {
+    Scheduler *scheduler = worker->scheduler;
+    void *item = worker->next;
+
+    if (item) {
+        worker->next = NULL;
+        return item;
+    }
+    item = deque_pop(&worker->deque);
+    if (item) {
+        return item;
+    }
+
+    // Move a batch from the inbox so it can be stolen while we run the first
+    item = try_dequeue(&worker->inbox);
+    if (item) {
+        for (int i = 1; i < INBOX_BATCH; i++) {
+            void *next = try_dequeue(&worker->inbox);
+            if (!next) break;
+            if (deque_push(&worker->deque, next) != 0) {
+                // Deque full. Put it back without waiting: submitters may
+                // have refilled the inbox, and only we drain it
+                if (try_enqueue(&worker->inbox, next) != 0) {
+                    worker->next = next;
+                }
+                break;
+            }
+        }
+        return item;
+    }
+
+    for (int i = 1; i < scheduler->count; i++) {
+        Worker *victim = &scheduler->workers[(worker->id + i) % scheduler->count];
+        if ((item = deque_steal(&victim->deque)) != NULL || (item = try_dequeue(&victim->inbox)) != NULL) {
+            return item;
+        }
+    }
+    return NULL;
+}
+
+static void scheduler_wake(Scheduler *scheduler) {
+    // Order the caller's push before the sleeper check (pairs with the
+    // increment in scheduler_worker)
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load(&scheduler->sleepers) > 0) {
+        sem_post(&scheduler->wakeup);
+    }
+}
+
+static void *scheduler_worker(void *arg) {
+    Worker *worker = (Worker *)arg;
+    Scheduler *scheduler = worker->scheduler;
+
+    if (scheduler->pin) {
+#ifdef CPU_SET
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(worker->id % (cpus > 0 ? cpus : 1), &set);
+        if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0) {
+            fprintf(stderr, "Could not pin worker %d.\n", worker->id);
+        }
+#endif
+    }
+    if (scheduler->worker_init) {
+        scheduler->worker_init(worker->id);
+    }
+
+    while (!atomic_load(&scheduler->stopping)) {
+        void *item = scheduler_find_work(worker);
+        if (item) {
+            scheduler->handler(item);
+            continue;
+        }
+
+        // Announce the park, then look once more: a submitter either sees the
+        // sleeper and posts, or we see its item here
+        atomic_fetch_add(&scheduler->sleepers, 1);
+        item = scheduler_find_work(worker);
+        if (item == NULL && !atomic_load(&scheduler->stopping)) {
+            while (sem_wait(&scheduler->wakeup) != 0) {
+                // Interrupted by a signal, wait again
+            }
+        }
+        atomic_fetch_sub(&scheduler->sleepers, 1);
+        if (item) {
+            scheduler->handler(item);
+        }
+    }
+    return NULL;
+}
+
+// Returns 0 on success, -1 on failure
+int scheduler_start(Scheduler *scheduler, int workers, size_t stack_size, int pin,
+                    void (*handler)(void *item), void (*worker_init)(int worker)) {
+    pthread_attr_t attr;
+
+    memset(scheduler, 0, sizeof(Scheduler));
+    scheduler->workers = calloc(workers, sizeof(Worker));
+    if (!scheduler->workers) {
+        return -1;
+    }
+    scheduler->count = workers;
+    scheduler->pin = pin;
+    scheduler->handler = handler;
+    scheduler->worker_init = worker_init;
+    atomic_init(&scheduler->next_inbox, 0);
+    atomic_init(&scheduler->sleepers, 0);
+    atomic_init(&scheduler->stopping, 0);
+    sem_init(&scheduler->wakeup, 0, 0);
+
+    for (int i = 0; i < workers; i++) {
+        Worker *worker = &scheduler->workers[i];
+        worker->scheduler = scheduler;
+        worker->id = i;
+        if (deque_init(&worker->deque, DEQUE_CAPACITY) != 0 || init_queue(&worker->inbox, INBOX_CAPACITY, 0) != 0) {
+            return -1;
+        }
+    }
+
+    pthread_attr_init(&attr);
+    if (stack_size) {
+        pthread_attr_setstacksize(&attr, stack_size);
+    }
+    for (int i = 0; i < workers; i++) {
+        if (pthread_create(&scheduler->workers[i].thread, &attr, scheduler_worker, &scheduler->workers[i]) != 0) {
+            pthread_attr_destroy(&attr);
+            return -1;
+        }
+    }
+    pthread_attr_destroy(&attr);
+    return 0;
+}
+
+// Submit from outside the pool. Waits for room when every inbox is full.
+void scheduler_submit(Scheduler *scheduler, void *item) {
+    unsigned start = atomic_fetch_add_explicit(&scheduler->next_inbox, 1, memory_order_relaxed);
+
+    while (1) {
+        for (int i = 0; i < scheduler->count; i++) {
+            Worker *worker = &scheduler->workers[(start + i) % scheduler->count];
+            if (try_enqueue(&worker->inbox, item) == 0) {
+                scheduler_wake(scheduler);
+                return;
+            }
+        }
+        sched_yield();
+    }
+}
+
+// Stop and join every worker. Items still queued are not run.
+void scheduler_stop(Scheduler *scheduler) {
+    atomic_store(&scheduler->stopping, 1);
+    for (int i = 0; i < scheduler->count; i++) {
+        sem_post(&scheduler->wakeup);
+    }
+    for (int i = 0; i < scheduler->count; i++) {
+        pthread_join(scheduler->workers[i].thread, NULL);
+    }
+    for (int i = 0; i < scheduler->count; i++) {
+        deque_destroy(&scheduler->workers[i].deque);
+        destroy_queue(&scheduler->workers[i].inbox);
+    }
+    sem_destroy(&scheduler->wakeup);
+    free(scheduler->workers);
+    scheduler->workers = NULL;
+}
+
+// Approximate number of items waiting to run
+size_t scheduler_pending(Scheduler *scheduler) {
+    size_t pending = 0;
+
+    for (int i = 0; i < scheduler->count; i++) {
+        Worker *worker = &scheduler->workers[i];
+        long top = atomic_load_explicit(&worker->deque.top, memory_order_relaxed);
+        long bottom = atomic_load_explicit(&worker->deque.bottom, memory_order_relaxed);
+        pending += queue_depth(&worker->inbox) + (bottom > top ? (size_t)(bottom - top) : 0);
+    }
+    return pending;
+}
+
+#endif // SCHEDULER_H
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE // CPU affinity for pinned workers
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -13,378 +14,2968 @@
 #include <pthread.h>
 #include <ctype.h>
 #include <stdint.h>
+#include <limits.h>
+#include <semaphore.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/sendfile.h>
+#include <sys/eventfd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "arena.h"
+#include "queue.h"
+#include "uring.h"
+#include "scheduler.h"
+#include "fairqueue.h"
+#include "protocol.h"
 
 #define PORT 8001
 #define MINI_BUFFER_SIZE 512
 #define BUFFER_SIZE 1024
 #define FILE_PATH_BUFFER_SIZE 2048
-#define ARENA_SIZE (10 * 1024 * 1024) // 10MB
-#define ALIGNMENT 8 // Memory alignment
+#define CLIENT_THREAD_STACK_SIZE (64 * 1024) // Request buffers live in a region, not on the stack
+#define DEFAULT_WORKERS 16 // Worker threads serving connections, -w overrides
+#define MAX_EVENTS 256 // Readiness events handled per epoll_wait in event loop mode
+#define DEFAULT_LISTEN_BACKLOG 128 // Pending connections the kernel holds, -l overrides
+#define DEFAULT_MAX_IN_FLIGHT 256 // Admitted requests queued or being served, -c overrides
+#define DEFAULT_HIGH_WATERMARK 64 // Queue depth that starts shedding load, -H overrides
+#define DEFAULT_LOW_WATERMARK 16 // Queue depth that stops shedding load, -L overrides
+#define RETRY_AFTER_MS 50 // Retry hint per round of queued work ahead of a rejected client
+#define RETRY_AFTER_MAX_MS 5000
+#define DEFAULT_ID_WEIGHT 1 // Requests per fair-queue round for IDs without -W
+#define DEFAULT_SMALL_JOB_BYTES (1024 * 1024) // Transfers up to this size are small jobs, -s overrides
+#define DEFAULT_SMALL_LANE_WORKERS 2 // Workers reserved for small jobs, -n overrides
+#define DEFAULT_IDLE_TIMEOUT 60 // Seconds a connection may wait between or partway through requests, -t overrides
+#define IDLE_SWEEP_MS 1000 // How often the idle poller looks for connections past their deadline
+#define SERVER_ROOT "/home/sana-hashim/Desktop/bscs22101_bscs22017_Group_D_OS-main"
+
+// State of one connection, from accept until it is closed
+struct client_info {
+    FairItem fair;           // Link in the fair queue, must stay first
+    int client_socket;
+    const char *folder_path; // Shared server root, not copied per connection
+    struct request *request; // Parsed command, set at intake
+    int small;               // Queued on the small-job lane
+    Region region;           // Every buffer of this connection, freed in one shot
+    size_t partial_length;   // Bytes of the next request's header and name received so far
+    unsigned char partial[PROTOCOL_HEADER_SIZE + PROTOCOL_NAME_MAX];
+    long long idle_deadline; // When the idle poller closes it, unless its request is in by then
+    struct client_info *idle_next;  // On idle_connections while the poller watches it
+    struct client_info **idle_link; // The pointer to it on that list, NULL when off it
+};
+
+// Pool of client_info objects so the accept loop never calls mymalloc
+Slab client_info_slab;
+
+void construct_client_info(void *object) {
+    struct client_info *info = (struct client_info *)object;
+    memset(info, 0, sizeof(struct client_info));
+    info->client_socket = -1;
+    info->folder_path = SERVER_ROOT;
+}
+
+// Worker pool; accepted connections are spread over its per-worker queues
+Scheduler scheduler;
+
+// Parsed requests wait here, per ID, until a dispatch token picks them in
+// weighted round-robin order. Every queued request adds one token to the
+// scheduler; a token serves whichever request is next in fair order.
+FairQueue fair_queue;
+static char dispatch_token;
+
+// Shortest job first. Views and transfers up to small_job_bytes are queued
+// apart and served by a few workers of their own, and bulk workers take them
+// before their own work; a bulk transfer yields the CPU at chunk boundaries
+// while any small job is waiting or running.
+enum job_class {
+    JOB_VIEW,  // Directory listing or other metadata-only work
+    JOB_SMALL, // Transfer of at most small_job_bytes
+    JOB_LARGE  // Bigger or unknown-size transfer
+};
+
+FairQueue small_queue;
+Scheduler small_lane;
+long long small_job_bytes = DEFAULT_SMALL_JOB_BYTES;
+_Atomic int small_jobs;               // Small jobs queued or running
+static __thread int serving_large;    // This worker is in a bulk transfer
+
+// Admission control. Intake turns a request away with a busy reply once
+// max_in_flight requests are admitted, or while the scheduler queue is above
+// the high watermark; shedding stops only once the queue drains below the
+// low watermark, so the server does not flap at the threshold. Requests are
+// counted, not connections, so clients idling between requests hold no slot.
+struct admission_control {
+    int max_in_flight;
+    size_t high_watermark;
+    size_t low_watermark;
+    int workers;
+    _Atomic int shedding;
+    _Atomic int in_flight; // Admitted and not yet served
+};
+
+struct admission_control admission = {
+    .max_in_flight = DEFAULT_MAX_IN_FLIGHT,
+    .high_watermark = DEFAULT_HIGH_WATERMARK,
+    .low_watermark = DEFAULT_LOW_WATERMARK,
+    .workers = DEFAULT_WORKERS,
+};
+
+// Reader/writer locks for stored files, striped by a hash of (ID, filename).
+// Downloads and stats share a lock, uploads hold it exclusively, and
+// transfers of unrelated files only meet when their keys share a stripe.
+// Views take none: a listing reports each entry as it is at that moment.
+// The event loop's requests and streams take them without waiting, see
+// try_lock_file.
+#define FILE_LOCK_STRIPES 256 // Power of two
+pthread_rwlock_t file_locks[FILE_LOCK_STRIPES];
+
+// Transfer backends: zero-copy sendfile/splice first, then io_uring when the
+// kernel allows it, and the copy loops cover the rest
+int use_zero_copy = 1;
+int use_uring = 1;
+int use_pipeline = 0; // Receive and write uploads in separate stages, -b pipeline
+int preallocate = 0; // fallocate uploads that declare their size, -f enables
+
+#define SENDFILE_CHUNK (1024 * 1024) // Bytes per sendfile call; bulk downloads yield between calls
+#define SPLICE_CHUNK (1024 * 1024)   // Bytes per splice from the socket; bulk uploads yield between calls
+#define SPLICE_PIPE_SIZE (1024 * 1024) // Requested capacity of the upload pipe
+#define PIPELINE_BUFFERS 4 // Upload buffers in flight between the network and disk stages
+#define PIPELINE_BUFFER_SIZE (256 * 1024)
+#define DEFAULT_DISK_WRITERS 4 // Threads of the pipelined upload disk stage
+
+// Calling worker's ring, NULL when its transfers use the copy loops
+static __thread Uring *transfer_ring = NULL;
+
+#define URING_WRITE_TAG (1ULL << 32) // Marks write completions in user_data
+
+void init_file_locks(void) {
+    pthread_rwlockattr_t attr;
+
+    // A steady stream of downloads must not starve an upload of the same file
+    pthread_rwlockattr_init(&attr);
+    pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+    for (int i = 0; i < FILE_LOCK_STRIPES; i++) {
+        pthread_rwlock_init(&file_locks[i], &attr);
+    }
+    pthread_rwlockattr_destroy(&attr);
+}
+
+// Stripe of (id, filename)
+static pthread_rwlock_t *file_lock_stripe(const char *id, const char *filename) {
+    uint32_t hash = 2166136261u; // FNV-1a
+
+    for (const char *p = id; *p; p++) {
+        hash = (hash ^ (unsigned char)*p) * 16777619u;
+    }
+    hash = (hash ^ '/') * 16777619u;
+    for (const char *p = filename; *p; p++) {
+        hash = (hash ^ (unsigned char)*p) * 16777619u;
+    }
+
+    return &file_locks[hash & (FILE_LOCK_STRIPES - 1)];
+}
+
+// Lock the stripe of (id, filename)
+pthread_rwlock_t *lock_file(const char *id, const char *filename, int exclusive) {
+    pthread_rwlock_t *lock = file_lock_stripe(id, filename);
+    if (exclusive) {
+        pthread_rwlock_wrlock(lock);
+    } else {
+        pthread_rwlock_rdlock(lock);
+    }
+    return lock;
+}
+
+// Like lock_file, but returns NULL instead of waiting. The event loop only
+// takes locks this way: it must not stall its other connections, and a
+// stripe it already holds for one stream would never be released while it
+// waited on it for another.
+pthread_rwlock_t *try_lock_file(const char *id, const char *filename, int exclusive) {
+    pthread_rwlock_t *lock = file_lock_stripe(id, filename);
+    int taken = exclusive ? pthread_rwlock_trywrlock(lock) : pthread_rwlock_tryrdlock(lock);
+    return taken == 0 ? lock : NULL;
+}
+
+void unlock_file(pthread_rwlock_t *lock) {
+    pthread_rwlock_unlock(lock);
+}
+
+// Decide whether to admit one more request. Returns 0 and counts it in
+// flight if admitted, otherwise a retry-after hint in milliseconds.
+int admit_request(size_t queue_depth) {
+    if (admission.shedding && queue_depth <= admission.low_watermark) {
+        admission.shedding = 0;
+    } else if (!admission.shedding && queue_depth >= admission.high_watermark) {
+        admission.shedding = 1;
+    }
+    if (!admission.shedding) {
+        if (atomic_fetch_add(&admission.in_flight, 1) < admission.max_in_flight) {
+            return 0;
+        }
+        atomic_fetch_sub(&admission.in_flight, 1); // Over the cap, give it back
+    }
+
+    // Roughly how long the work ahead takes to drain
+    size_t retry_after = RETRY_AFTER_MS * (1 + queue_depth / admission.workers);
+    return retry_after > RETRY_AFTER_MAX_MS ? RETRY_AFTER_MAX_MS : (int)retry_after;
+}
+
+void release_request(void) {
+    atomic_fetch_sub(&admission.in_flight, 1);
+}
+
+// Turn a request away without tying up a worker. The caller closes the
+// socket: a client told to back off reconnects for what it still has to send.
+void reject_busy(int client_socket, int retry_after) {
+    MessageHeader header = {.opcode = OP_NONE, .status = STATUS_BUSY, .payload_length = 4};
+    unsigned char message[PROTOCOL_HEADER_SIZE + PROTOCOL_NAME_MAX];
+    uint32_t hint = htobe32((uint32_t)retry_after);
+
+    protocol_encode(&header, message);
+    memcpy(message + PROTOCOL_HEADER_SIZE, &hint, sizeof(hint));
+    send(client_socket, message, PROTOCOL_HEADER_SIZE + sizeof(hint), MSG_NOSIGNAL | MSG_DONTWAIT);
+    shutdown(client_socket, SHUT_WR);
+
+    // Drop pipelined requests already here: closing with unread data
+    // resets the connection, which can beat the reply to the client
+    recv(client_socket, message, sizeof(message), MSG_DONTWAIT);
+}
+
+// Function to check available disk space in bytes
+unsigned long long get_free_space(const char *path) {
+    struct statvfs stat;
+
+    if (statvfs(path, &stat) != 0) {
+        // Error getting filesystem statistics
+        return 0;
+    }
+
+    // Calculate the available space in bytes
+    return stat.f_bsize * stat.f_bavail;
+}
+
+// Create a directory if it doesn't exist. Concurrent uploads to a new ID
+// race to create it, so one that already exists counts as created. Returns
+// 0 on success, -1 if the directory cannot be created.
+int create_directory_if_not_exists(const char *path) {
+    if (mkdir(path, 0700) == 0) {
+        printf("Directory created: %s\n", path);
+        return 0;
+    }
+    if (errno == EEXIST) {
+        printf("Directory already exists: %s\n", path);
+        return 0;
+    }
+    perror("Failed to create directory");
+    return -1;
+}
+
+// Set an open file up to resume an upload at offset: anything stored past it
+// is dropped, so the file only ever holds a prefix of the content, and the
+// file position moves there. Returns -1 if the file is shorter than offset.
+int resume_file(int file_fd, off_t offset) {
+    struct stat file_stat;
+
+    if (fstat(file_fd, &file_stat) != 0 || file_stat.st_size < offset ||
+        ftruncate(file_fd, offset) != 0 || lseek(file_fd, offset, SEEK_SET) != offset) {
+        return -1;
+    }
+    return 0;
+}
+
+// Fields of a decoded request
+struct request {
+    int opcode;                          // enum protocol_opcode
+    uint32_t request_id;                 // Echoed in every reply
+    char id[PROTOCOL_ID_SIZE];
+    char filename[PROTOCOL_NAME_MAX + 1];
+    long long size;                      // Upload length from the header, -1 for other requests
+    long long offset;                    // Where the upload or download starts in the file
+    long long length;                    // Bytes a download asks for, 0 for all from offset;
+                                         // the whole file's size for a segment
+};
+
+// IDs and file names become path components, so they must name a single
+// entry inside the server root
+static int valid_path_component(const char *name, size_t length) {
+    if (length == 0 || strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
+        return 0;
+    }
+    return memchr(name, '/', length) == NULL && strlen(name) == length;
+}
+
+// Segments are uploads that land in a staging file
+static inline int is_upload(int opcode) {
+    return opcode == OP_UPLOAD || opcode == OP_SEGMENT;
+}
+
+// Check a received header and its name and fill request from them. Returns
+// STATUS_OK, or STATUS_BAD_REQUEST for anything the server cannot serve.
+int decode_request(const MessageHeader *header, const char *name, struct request *request) {
+    memset(request, 0, sizeof(struct request));
+    request->opcode = header->opcode;
+    request->request_id = header->request_id;
+    request->size = -1;
+    request->offset = (long long)header->offset;
+    request->length = (long long)header->length;
+    snprintf(request->id, sizeof(request->id), "%s", header->id);
+
+    if (!valid_path_component(request->id, strlen(request->id)) || request->offset < 0 || request->length < 0) {
+        return STATUS_BAD_REQUEST;
+    }
+    switch (header->opcode) {
+    case OP_SEGMENT:
+        // The range must lie inside the file it is part of
+        if ((long long)header->payload_length > request->length - request->offset) {
+            return STATUS_BAD_REQUEST;
+        }
+        // A segment is checked as an upload
+        __attribute__((fallthrough));
+    case OP_UPLOAD:
+        request->size = (long long)header->payload_length;
+        if (request->size < 0 || request->size > LLONG_MAX - request->offset) {
+            return STATUS_BAD_REQUEST;
+        }
+        // Uploads, downloads and stats all name a file
+        __attribute__((fallthrough));
+    case OP_DOWNLOAD:
+    case OP_STAT:
+        if (header->name_length > PROTOCOL_NAME_MAX) {
+            return STATUS_BAD_REQUEST;
+        }
+        memcpy(request->filename, name, header->name_length);
+        request->filename[header->name_length] = '\0';
+        if (!valid_path_component(request->filename, header->name_length)) {
+            return STATUS_BAD_REQUEST;
+        }
+        break;
+    case OP_VIEW:
+    case OP_MULTIPLEX:
+        break;
+    default:
+        return STATUS_BAD_REQUEST;
+    }
+    if (!is_upload(header->opcode) && header->payload_length != 0) {
+        return STATUS_BAD_REQUEST; // Only uploads carry content
+    }
+    return STATUS_OK;
+}
+
+// Reply to request with a bare header that reports the file's full size.
+// Returns 0 on success, -1 on error.
+int send_file_status(int client_socket, const struct request *request, int status, unsigned long long payload_length, long long file_size) {
+    MessageHeader header = {
+        .opcode = request->opcode,
+        .status = status,
+        .payload_length = payload_length,
+        .request_id = request->request_id,
+        .offset = request->offset,
+        .length = file_size,
+    };
+    return protocol_send(client_socket, &header, NULL);
+}
+
+// Reply to request with a bare header. Returns 0 on success, -1 on error.
+int send_status(int client_socket, const struct request *request, int status, unsigned long long payload_length) {
+    return send_file_status(client_socket, request, status, payload_length, 0);
+}
+
+// Segmented uploads in progress. Their segments arrive on separate
+// connections, possibly to different workers, and are written into a hidden
+// staging file beside the final one. The table merges the ranges stored so
+// far; the segment that completes the file renames it into place. It lives
+// in memory only, so segments stored before a restart are sent again.
+#define MAX_SEGMENTED_FILES 64
+#define MAX_SEGMENT_RANGES 64 // Disjoint stored ranges tracked per file
+#define SEGMENT_SUFFIX ".segments"
+#define STREAM_SUFFIX ".upload" // Staging files of multiplexed uploads, see open_stream
+
+struct segmented_file {
+    int active;
+    int committing;                   // Complete, being renamed into place
+    char id[PROTOCOL_ID_SIZE];
+    char filename[PROTOCOL_NAME_MAX + 1];
+    long long size;                   // Size of the whole file
+    int ranges;
+    struct {
+        long long start, end;
+    } stored[MAX_SEGMENT_RANGES];     // Sorted, neither overlapping nor touching
+};
+
+struct segmented_file segmented_files[MAX_SEGMENTED_FILES];
+pthread_mutex_t segments_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int has_suffix(const char *name, const char *suffix) {
+    size_t length = strlen(name), suffix_length = strlen(suffix);
+    return length > suffix_length + 1 && strcmp(name + length - suffix_length, suffix) == 0;
+}
+
+// Staging files are named ".<filename>.segments", or for a multiplexed
+// upload ".<filename>.<socket>.<stream>.upload"
+int is_staging_name(const char *name) {
+    return name[0] == '.' && (has_suffix(name, SEGMENT_SUFFIX) || has_suffix(name, STREAM_SUFFIX));
+}
+
+// Caller holds segments_lock
+static struct segmented_file *find_segmented_file(const struct request *request) {
+    for (int i = 0; i < MAX_SEGMENTED_FILES; i++) {
+        struct segmented_file *file = &segmented_files[i];
+        if (file->active && strcmp(file->id, request->id) == 0 && strcmp(file->filename, request->filename) == 0) {
+            return file;
+        }
+    }
+    return NULL;
+}
+
+// Add [start, end) to the stored ranges, merging it with those it overlaps
+// or touches. Returns -1 if the table has no room for another range.
+static int add_stored_range(struct segmented_file *file, long long start, long long end) {
+    int first = 0, last;
+
+    if (start >= end) {
+        return 0;
+    }
+    while (first < file->ranges && file->stored[first].end < start) {
+        first++;
+    }
+    for (last = first; last < file->ranges && file->stored[last].start <= end; last++) {
+        if (file->stored[last].start < start) start = file->stored[last].start;
+        if (file->stored[last].end > end) end = file->stored[last].end;
+    }
+    if (last == first && file->ranges == MAX_SEGMENT_RANGES) {
+        return -1;
+    }
+
+    // Ranges first..last-1 become the merged one
+    memmove(&file->stored[first + 1], &file->stored[last], (file->ranges - last) * sizeof(file->stored[0]));
+    file->ranges += 1 - (last - first);
+    file->stored[first].start = start;
+    file->stored[first].end = end;
+    return 0;
+}
+
+// Drop [start, end) from the stored ranges: its bytes are about to be
+// written again. Splitting a range needs a free slot; without one the part
+// past end is dropped as well, which only means it is sent again.
+static void remove_stored_range(struct segmented_file *file, long long start, long long end) {
+    for (int i = 0; i < file->ranges && start < end; i++) {
+        long long range_start = file->stored[i].start, range_end = file->stored[i].end;
+
+        if (range_end <= start || range_start >= end) {
+            continue;
+        }
+        if (range_start < start && range_end > end && file->ranges < MAX_SEGMENT_RANGES) {
+            memmove(&file->stored[i + 2], &file->stored[i + 1], (file->ranges - i - 1) * sizeof(file->stored[0]));
+            file->ranges++;
+            file->stored[i].end = start;
+            file->stored[i + 1].start = end;
+            file->stored[i + 1].end = range_end;
+            return;
+        }
+        if (range_start < start) {
+            file->stored[i].end = start;
+        } else if (range_end > end) {
+            file->stored[i].start = end;
+        } else {
+            memmove(&file->stored[i], &file->stored[i + 1], (file->ranges - i - 1) * sizeof(file->stored[0]));
+            file->ranges--;
+            i--;
+        }
+    }
+}
+
+// Open the staging file for a segment of request, positioned at its offset.
+// The first segment of a file, or one announcing a different size, starts
+// it over, preallocated to the full size. The segment's range stops counting
+// as stored until complete_segment records it again, so a retry that fails
+// part way never leaves the table claiming bytes it overwrote. Returns the
+// descriptor, or -1 with the status to reply in *status.
+int open_segment(const struct request *request, const char *folder_path, int *status) {
+    char staging[FILE_PATH_BUFFER_SIZE];
+    struct segmented_file *file;
+
+    snprintf(staging, sizeof(staging), "%s/%s/.%s" SEGMENT_SUFFIX, folder_path, request->id, request->filename);
+
+    // Held while the staging file is set up, so no segment writes into it
+    // before it is truncated
+    pthread_mutex_lock(&segments_lock);
+    file = find_segmented_file(request);
+    if (file != NULL && file->committing) {
+        // The staging name is about to move; the client retries once it has
+        pthread_mutex_unlock(&segments_lock);
+        *status = STATUS_BUSY;
+        return -1;
+    }
+    int fresh = file == NULL || file->size != request->length;
+    for (int i = 0; file == NULL && i < MAX_SEGMENTED_FILES; i++) {
+        if (!segmented_files[i].active) {
+            file = &segmented_files[i];
+        }
+    }
+    if (file == NULL) {
+        pthread_mutex_unlock(&segments_lock);
+        *status = STATUS_BUSY;
+        return -1;
+    }
+
+    int file_fd = open(staging, O_WRONLY | O_CREAT, 0666);
+    if (file_fd != -1 && fresh) {
+        file->active = 1;
+        snprintf(file->id, sizeof(file->id), "%s", request->id);
+        snprintf(file->filename, sizeof(file->filename), "%s", request->filename);
+        file->size = request->length;
+        file->ranges = 0;
+        if (ftruncate(file_fd, 0) != 0 ||
+            (fallocate(file_fd, 0, 0, request->length) != 0 && (errno == ENOSPC || ftruncate(file_fd, request->length) != 0))) {
+            *status = errno == ENOSPC ? STATUS_NO_SPACE : STATUS_ERROR;
+            file->active = 0;
+            close(file_fd);
+            file_fd = -1;
+        }
+    } else if (file_fd == -1) {
+        *status = STATUS_ERROR;
+    } else {
+        remove_stored_range(file, request->offset, request->offset + request->size);
+    }
+    pthread_mutex_unlock(&segments_lock);
+
+    if (file_fd != -1 && lseek(file_fd, request->offset, SEEK_SET) != request->offset) {
+        *status = STATUS_ERROR;
+        close(file_fd);
+        return -1;
+    }
+    return file_fd;
+}
+
+// Record a segment of request as stored. Returns 1 if the stored ranges now
+// cover the whole file, which is then committing: the caller renames it into
+// place with commit_segment, or gives up with abandon_segment. Returns 0 if
+// other segments are still missing, -1 if the transfer was started over
+// meanwhile.
+int record_segment(const struct request *request) {
+    int result = -1;
+
+    pthread_mutex_lock(&segments_lock);
+    struct segmented_file *file = find_segmented_file(request);
+    if (file != NULL && !file->committing && file->size == request->length &&
+        add_stored_range(file, request->offset, request->offset + request->size) == 0) {
+        result = 0;
+        if (file->size == 0 || (file->ranges == 1 && file->stored[0].start == 0 && file->stored[0].end == file->size)) {
+            // Keeps the entry, so no new transfer of the file opens the
+            // staging name until it has moved
+            file->committing = 1;
+            result = 1;
+        }
+    }
+    pthread_mutex_unlock(&segments_lock);
+    return result;
+}
+
+// Move the committing file of request into place and drop its entry. The
+// caller holds the file's write lock. Returns 1, or -1 if the rename failed.
+int commit_segment(const struct request *request, const char *folder_path) {
+    char staging[FILE_PATH_BUFFER_SIZE];
+    char path[FILE_PATH_BUFFER_SIZE];
+
+    snprintf(staging, sizeof(staging), "%s/%s/.%s" SEGMENT_SUFFIX, folder_path, request->id, request->filename);
+    snprintf(path, sizeof(path), "%s/%s/%s", folder_path, request->id, request->filename);
+    int result = rename(staging, path) == 0 ? 1 : -1;
+
+    pthread_mutex_lock(&segments_lock);
+    struct segmented_file *file = find_segmented_file(request);
+    if (file != NULL) {
+        file->committing = 0;
+        file->active = 0;
+    }
+    pthread_mutex_unlock(&segments_lock);
+    return result;
+}
+
+// Leave the committing file of request complete but unmoved. The next
+// segment sent again completes and commits it.
+void abandon_segment(const struct request *request) {
+    pthread_mutex_lock(&segments_lock);
+    struct segmented_file *file = find_segmented_file(request);
+    if (file != NULL) {
+        file->committing = 0;
+    }
+    pthread_mutex_unlock(&segments_lock);
+}
+
+// Record a segment of request as stored and, if that completes the file,
+// rename it into place. Returns like record_segment, or -1 if the rename
+// failed.
+int complete_segment(const struct request *request, const char *folder_path) {
+    int result = record_segment(request);
+    if (result != 1) {
+        return result;
+    }
+
+    // The file lock may wait on long downloads, so it is taken without
+    // segments_lock held: other files' segments carry on meanwhile
+    pthread_rwlock_t *lock = lock_file(request->id, request->filename, 1);
+    result = commit_segment(request, folder_path);
+    unlock_file(lock);
+    return result;
+}
+
+// Chunk boundary of a transfer: a bulk transfer steps aside while small jobs
+// are waiting or running
+static inline void yield_to_small_jobs(void) {
+    if (serving_large && atomic_load_explicit(&small_jobs, memory_order_relaxed) > 0) {
+        sched_yield();
+    }
+}
+
+// Zero-copy download of length bytes from start: the kernel moves page cache
+// pages straight to the socket. Returns -1 if sendfile is not supported for
+// this file (nothing was sent, use another path), otherwise the bytes sent.
+long long sendfile_download(int client_socket, int file_fd, off_t start, long long length) {
+    off_t offset = start;
+    off_t end = start + length;
+
+    while (offset < end) {
+        size_t left = end - offset;
+        ssize_t sent = sendfile(client_socket, file_fd, &offset, left < SENDFILE_CHUNK ? left : SENDFILE_CHUNK);
+        if (sent < 0) {
+            if (errno == EINTR) continue;
+            if (offset == start && (errno == EINVAL || errno == ENOSYS)) {
+                return -1;
+            }
+            perror("sendfile failed");
+            break;
+        }
+        if (sent == 0) {
+            break; // The file shrank under us
+        }
+        yield_to_small_jobs();
+    }
+    return offset - start;
+}
+
+// Zero-copy upload: splice moves socket buffers into a pipe and the pipe's
+// pages into the file, so the payload never reaches user space. The known
+// length lets the file be preallocated in one extent. Writes go to the file
+// position, start. With trim, a short upload cuts the file after its last
+// byte; segments share their file and leave it alone. Returns -1 if splice is
+// not supported here (nothing was received, use another path), otherwise the
+// bytes stored, short of length if the client hung up or a write failed.
+long long splice_upload(int client_socket, int file_fd, off_t start, long long length, int trim) {
+    int pipe_fds[2];
+    long long received = 0;
+    long long stored = 0;
+
+    if (pipe(pipe_fds) != 0) {
+        return -1;
+    }
+    fcntl(pipe_fds[1], F_SETPIPE_SZ, SPLICE_PIPE_SIZE); // Larger moves per call if allowed
+    if (preallocate && trim && length > 0) {
+        // Keep the size so a short upload leaves no zero tail behind
+        fallocate(file_fd, FALLOC_FL_KEEP_SIZE, start, length);
+    }
+
+    while (received < length) {
+        size_t want = length - received < SPLICE_CHUNK ? (size_t)(length - received) : SPLICE_CHUNK;
+        ssize_t in = splice(client_socket, NULL, pipe_fds[1], NULL, want, SPLICE_F_MOVE | SPLICE_F_MORE);
+        if (in < 0) {
+            if (errno == EINTR) continue;
+            if (received == 0 && (errno == EINVAL || errno == ENOSYS)) {
+                close(pipe_fds[0]);
+                close(pipe_fds[1]);
+                return -1;
+            }
+            perror("splice from socket failed");
+            break;
+        }
+        if (in == 0) {
+            break; // The client hung up early
+        }
+        received += in;
+
+        // Drain the pipe into the file before taking more
+        while (in > 0) {
+            ssize_t out = splice(pipe_fds[0], NULL, file_fd, NULL, in, SPLICE_F_MOVE | SPLICE_F_MORE);
+            if (out < 0) {
+                if (errno == EINTR) continue;
+                perror("splice to file failed");
+                goto done;
+            }
+            in -= out;
+            stored += out;
+        }
+        yield_to_small_jobs();
+    }
+
+done:
+    if (preallocate && trim && length > stored) {
+        ftruncate(file_fd, start + stored); // Give back the unused preallocation
+    }
+    close(pipe_fds[0]);
+    close(pipe_fds[1]);
+    return stored;
+}
+
+// Pipelined upload. The worker is the network stage: it fills one of
+// PIPELINE_BUFFERS buffers from the socket and hands it to the disk stage, a
+// small pool of writer threads that pwrite it at its offset. A buffer returns
+// to the worker once written, so a slow disk holds back the socket by at most
+// the ring's worth of data instead of on every chunk, and vice versa.
+struct upload_pipeline;
+
+struct upload_chunk {
+    struct upload_pipeline *pipeline;
+    char *data;
+    size_t length;
+    off_t offset;
+    sem_t free;           // Posted by the disk stage once the buffer is written
+};
+
+struct upload_pipeline {
+    int file_fd;
+    _Atomic int failed;   // A write failed; the rest of the upload is drained and dropped
+    struct upload_chunk chunks[PIPELINE_BUFFERS];
+};
+
+Scheduler disk_writers;
+
+// Disk stage: write one chunk, then give its buffer back
+void write_upload_chunk(void *arg) {
+    struct upload_chunk *chunk = (struct upload_chunk *)arg;
+    struct upload_pipeline *pipeline = chunk->pipeline;
+    size_t written = 0;
+
+    while (written < chunk->length && !atomic_load(&pipeline->failed)) {
+        ssize_t n = pwrite(pipeline->file_fd, chunk->data + written, chunk->length - written, chunk->offset + written);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            perror("Error writing uploaded file");
+            atomic_store(&pipeline->failed, 1);
+            break;
+        }
+        written += n;
+    }
+    sem_post(&chunk->free);
+}
+
+// Network stage, on the calling worker. Returns -1 if the buffers could not
+// be allocated (nothing was received, use another path), otherwise the bytes
+// stored from start: short of length if the client hung up, 0 if a write
+// failed.
+long long pipelined_upload(int client_socket, int file_fd, off_t start, long long length, Region *region) {
+    struct upload_pipeline *pipeline = region_alloc(region, sizeof(struct upload_pipeline));
+    off_t offset = 0;
+
+    if (!pipeline) {
+        return -1;
+    }
+    for (int i = 0; i < PIPELINE_BUFFERS; i++) {
+        if ((pipeline->chunks[i].data = region_alloc(region, PIPELINE_BUFFER_SIZE)) == NULL) {
+            return -1;
+        }
+    }
+    pipeline->file_fd = file_fd;
+    atomic_init(&pipeline->failed, 0);
+    for (int i = 0; i < PIPELINE_BUFFERS; i++) {
+        pipeline->chunks[i].pipeline = pipeline;
+        sem_init(&pipeline->chunks[i].free, 0, 1);
+    }
+
+    for (int next = 0; offset < length; next = (next + 1) % PIPELINE_BUFFERS) {
+        struct upload_chunk *chunk = &pipeline->chunks[next];
+        size_t want = length - offset < PIPELINE_BUFFER_SIZE ? (size_t)(length - offset) : PIPELINE_BUFFER_SIZE;
+
+        // Backpressure: wait for the disk stage to return this buffer. Writes
+        // may finish out of order, so each buffer is waited for by itself.
+        while (sem_wait(&chunk->free) != 0) {
+            // Interrupted by a signal, wait again
+        }
+
+        // Fill the whole buffer unless the client hangs up first
+        chunk->length = 0;
+        while (chunk->length < want) {
+            ssize_t received = recv(client_socket, chunk->data + chunk->length, want - chunk->length, MSG_WAITALL);
+            if (received < 0 && errno == EINTR) continue;
+            if (received <= 0) break;
+            chunk->length += received;
+        }
+        if (chunk->length == 0) {
+            sem_post(&chunk->free);
+            break;
+        }
+
+        chunk->offset = start + offset;
+        offset += chunk->length;
+        scheduler_submit(&disk_writers, chunk);
+        if (chunk->length < want) {
+            break; // Short fill: the client hung up
+        }
+        yield_to_small_jobs();
+    }
+
+    // Wait for the disk stage to finish with every buffer
+    for (int i = 0; i < PIPELINE_BUFFERS; i++) {
+        while (sem_wait(&pipeline->chunks[i].free) != 0) {
+            // Interrupted by a signal, wait again
+        }
+        sem_destroy(&pipeline->chunks[i].free);
+    }
+    return atomic_load(&pipeline->failed) ? 0 : offset;
+}
+
+// Upload through io_uring: receive into the ring's registered buffers and
+// write each chunk at its offset with WRITE_FIXED. The write of one chunk and
+// the receive of the next go to the kernel in the same io_uring_enter, and up
+// to URING_BUFFERS chunks can be in flight. Returns -1 if the ring could not
+// take the transfer (nothing was read yet, use the copy loop), otherwise the
+// bytes stored from start: short of length if the client hung up, 0 if a
+// write failed.
+long long uring_upload(Uring *ring, int client_socket, int file_fd, off_t start, long long length) {
+    int fds[URING_FILES] = {client_socket, file_fd};
+    unsigned lengths[URING_BUFFERS] = {0}; // Bytes being written from each buffer
+    off_t offsets[URING_BUFFERS] = {0};    // File offset of each buffer's chunk
+    int busy[URING_BUFFERS] = {0};
+    unsigned next = 0;
+    int in_flight = 0;
+    int receiving = length > 0;
+    int recv_pending = 0;
+    int failed = 0;
+    off_t offset = 0;
+
+    if (uring_set_files(ring, fds, URING_FILES) != 0) {
+        return -1;
+    }
+
+    while (1) {
+        // Keep one receive outstanding whenever a buffer is free
+        if (receiving && !recv_pending) {
+            for (unsigned i = 0; i < URING_BUFFERS; i++) {
+                unsigned index = (next + i) % URING_BUFFERS;
+                if (busy[index]) continue;
+
+                struct io_uring_sqe *sqe = uring_get_sqe(ring);
+                sqe->opcode = IORING_OP_RECV;
+                sqe->flags = IOSQE_FIXED_FILE;
+                sqe->fd = 0;
+                sqe->addr = (unsigned long)uring_buffer(ring, index);
+                sqe->len = length - offset < URING_BUFFER_SIZE ? (unsigned)(length - offset) : URING_BUFFER_SIZE;
+                sqe->user_data = index;
+                busy[index] = 1;
+                recv_pending = 1;
+                in_flight++;
+                next = (index + 1) % URING_BUFFERS;
+                break;
+            }
+        }
+        if (in_flight == 0) {
+            break;
+        }
+        yield_to_small_jobs();
+        if (uring_submit_and_wait(ring, 1) < 0) {
+            perror("io_uring_enter failed");
+            break;
+        }
+
+        struct io_uring_cqe *cqe;
+        while ((cqe = uring_peek_cqe(ring)) != NULL) {
+            unsigned index = (unsigned)(cqe->user_data & ~URING_WRITE_TAG);
+            int is_write = (cqe->user_data & URING_WRITE_TAG) != 0;
+            int res = cqe->res;
+            uring_cqe_seen(ring);
+            in_flight--;
+
+            if (is_write) {
+                if (res < 0) {
+                    fprintf(stderr, "Error writing uploaded file: %s\n", strerror(-res));
+                    receiving = 0;
+                    failed = 1;
+                } else if ((unsigned)res < lengths[index]) {
+                    // Short write, finish the chunk directly
+                    char *buffer = uring_buffer(ring, index);
+                    if (pwrite(file_fd, buffer + res, lengths[index] - res, offsets[index] + res) < 0) {
+                        perror("Error writing uploaded file");
+                        receiving = 0;
+                        failed = 1;
+                    }
+                }
+                busy[index] = 0;
+                lengths[index] = 0;
+                continue;
+            }
+
+            recv_pending = 0;
+            if (res <= 0) {
+                // The client closed the connection (or failed); drain the writes
+                busy[index] = 0;
+                receiving = 0;
+                continue;
+            }
+
+            struct io_uring_sqe *sqe = uring_get_sqe(ring);
+            sqe->opcode = IORING_OP_WRITE_FIXED;
+            sqe->flags = IOSQE_FIXED_FILE;
+            sqe->fd = 1;
+            sqe->addr = (unsigned long)uring_buffer(ring, index);
+            sqe->len = res;
+            sqe->off = start + offset;
+            sqe->buf_index = index;
+            sqe->user_data = index | URING_WRITE_TAG;
+            lengths[index] = res;
+            offsets[index] = start + offset;
+            offset += res;
+            in_flight++;
+            if (offset == length) {
+                receiving = 0; // Every byte is in, finish the writes
+            }
+        }
+    }
+
+    uring_release_files(ring);
+    return failed ? 0 : offset;
+}
+
+// Download through io_uring: each batch is one chain of READ_FIXED -> SEND
+// pairs over the registered buffers, submitted and reaped with a single
+// io_uring_enter. A short or failed step cancels the rest of the chain.
+// Sends length bytes from start. Returns -1 if the ring could not take the
+// transfer (nothing was sent yet, use the copy loop), otherwise the bytes
+// sent.
+long long uring_download(Uring *ring, int client_socket, int file_fd, off_t start, long long length) {
+    int fds[URING_FILES] = {client_socket, file_fd};
+    off_t end = start + length;
+    off_t offset = start;
+    off_t sent = start;
+
+    if (uring_set_files(ring, fds, URING_FILES) != 0) {
+        return -1;
+    }
+
+    while (offset < end) {
+        struct io_uring_sqe *sqe = NULL;
+        unsigned submitted = 0;
+        int failed = 0;
+
+        for (unsigned i = 0; i < URING_BUFFERS && offset < end; i++) {
+            unsigned chunk = URING_BUFFER_SIZE;
+            if (end - offset < chunk) {
+                chunk = (unsigned)(end - offset);
+            }
+
+            sqe = uring_get_sqe(ring);
+            sqe->opcode = IORING_OP_READ_FIXED;
+            sqe->flags = IOSQE_FIXED_FILE | IOSQE_IO_LINK;
+            sqe->fd = 1;
+            sqe->addr = (unsigned long)uring_buffer(ring, i);
+            sqe->len = chunk;
+            sqe->off = offset;
+            sqe->buf_index = i;
+            sqe->user_data = chunk; // Both steps must move the whole chunk
+
+            sqe = uring_get_sqe(ring);
+            sqe->opcode = IORING_OP_SEND;
+            sqe->flags = IOSQE_FIXED_FILE | IOSQE_IO_LINK;
+            sqe->fd = 0;
+            sqe->addr = (unsigned long)uring_buffer(ring, i);
+            sqe->len = chunk;
+            sqe->msg_flags = MSG_WAITALL | MSG_NOSIGNAL;
+            sqe->user_data = chunk;
+
+            offset += chunk;
+            submitted += 2;
+        }
+        sqe->flags &= ~IOSQE_IO_LINK; // End of this batch's chain
+
+        yield_to_small_jobs();
+        if (uring_submit_and_wait(ring, submitted) < 0) {
+            perror("io_uring_enter failed");
+            break; // Nothing else can be reaped from a failed ring
+        }
+        for (unsigned i = 0; i < submitted; i++) {
+            struct io_uring_cqe *cqe = uring_wait_cqe(ring);
+            if (cqe == NULL) {
+                failed = 1;
+                break;
+            }
+            if (cqe->res != (int)cqe->user_data) {
+                failed = 1;
+            }
+            uring_cqe_seen(ring);
+        }
+        if (failed) {
+            fprintf(stderr, "Download stopped after a failed or short transfer.\n");
+            break;
+        }
+        sent = offset; // The whole batch went out
+    }
+
+    uring_release_files(ring);
+    return sent - start;
+}
+
+// Directory listing of client_dir, one line per entry, in a region buffer
+// that keeps PROTOCOL_HEADER_SIZE bytes free in front for the reply header.
+// Returns the buffer and the listing's length, or NULL if the directory
+// cannot be read.
+char *format_listing(const char *client_dir, Region *region, size_t *length) {
+    DIR *dir = opendir(client_dir);
+    struct dirent *entry;
+    struct stat file_stat;
+    char modified[32];
+    size_t capacity = BUFFER_SIZE * 2;
+    char *file_path = region_alloc(region, FILE_PATH_BUFFER_SIZE * 4);
+    char *listing = region_alloc(region, PROTOCOL_HEADER_SIZE + capacity);
+
+    *length = 0;
+    if (dir == NULL || !file_path || !listing) {
+        perror("Error opening directory for reading");
+        if (dir) {
+            closedir(dir);
+        }
+        return NULL;
+    }
+
+    // Loop through the files in the directory
+    while ((entry = readdir(dir)) != NULL) {
+        // Skip "." and "..", and segmented uploads still being put together
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0 || is_staging_name(entry->d_name)) {
+            continue;
+        }
+
+        // Get file stats (size, modification time)
+        snprintf(file_path, FILE_PATH_BUFFER_SIZE * 4, "%s/%s", client_dir, entry->d_name);
+        if (stat(file_path, &file_stat) != 0) {
+            continue;
+        }
+
+        // Grow into a fresh region block when the next line may not fit; the
+        // old one goes with the region
+        if (capacity - *length < BUFFER_SIZE) {
+            char *grown = region_alloc(region, PROTOCOL_HEADER_SIZE + capacity * 2);
+            if (!grown) {
+                break;
+            }
+            memcpy(grown, listing, PROTOCOL_HEADER_SIZE + *length);
+            listing = grown;
+            capacity *= 2;
+        }
+
+        // Format the file details (ctime_r: listings run in parallel)
+        ctime_r(&file_stat.st_mtime, modified);
+        int written = snprintf(listing + PROTOCOL_HEADER_SIZE + *length, capacity - *length,
+                               "File: %s | Size: %ld bytes | Last modified: %s\n", entry->d_name, (long)file_stat.st_size, modified);
+        *length += written < (int)(capacity - *length) ? (size_t)written : capacity - *length - 1;
+    }
+
+    closedir(dir);
+    return listing;
+}
+
+// Receive length bytes of upload content into file, positioned at start,
+// through the first transfer path that takes them. The bytes are stored as
+// sent, so the zero-copy path applies whenever the kernel supports it.
+// buffer holds BUFFER_SIZE bytes; trim as for splice_upload. Returns the
+// bytes stored.
+long long receive_upload(int client_socket, FILE *file, off_t start, long long length, int trim, Region *region, char *buffer) {
+    int file_fd = fileno(file);
+    long long stored = -1;
+
+    if (use_pipeline) {
+        stored = pipelined_upload(client_socket, file_fd, start, length, region);
+    }
+    if (stored < 0 && use_zero_copy) {
+        stored = splice_upload(client_socket, file_fd, start, length, trim);
+    }
+    if (stored < 0 && transfer_ring != NULL) {
+        stored = uring_upload(transfer_ring, client_socket, file_fd, start, length);
+    }
+    if (stored < 0) {
+        stored = 0;
+        while (stored < length) {
+            size_t want = length - stored < BUFFER_SIZE ? (size_t)(length - stored) : BUFFER_SIZE;
+            int bytes_received = recv(client_socket, buffer, want, 0);
+            if (bytes_received <= 0 || fwrite(buffer, 1, bytes_received, file) != (size_t)bytes_received) {
+                break;
+            }
+            stored += bytes_received;
+            yield_to_small_jobs();
+        }
+    }
+    return stored;
+}
+
+// Function to process the file based on the command. Buffers come from the
+// connection's region and are released together before its next request.
+// Returns 0 if the connection can carry another request, -1 if the byte
+// stream is out of step (a transfer stopped short) and it must be closed.
+int process_file(const struct request *request, int client_socket, const char *folder_path, Region *region) {
+    char *client_dir = region_zalloc(region, FILE_PATH_BUFFER_SIZE * 3);
+    char *file_content = region_alloc(region, BUFFER_SIZE); // Transfer chunk for upload/download
+    size_t client_dir_size = FILE_PATH_BUFFER_SIZE * 3;
+
+    if (!client_dir || !file_content) {
+        printf("Could not allocate request buffers.\n");
+        send_status(client_socket, request, STATUS_ERROR, 0);
+        return 0;
+    }
+
+    const char *id = request->id;
+    const char *filename = request->filename;
+
+    snprintf(client_dir, client_dir_size, "%s/%s", folder_path, id);
+
+    if (request->opcode == OP_UPLOAD) {
+        if (create_directory_if_not_exists(client_dir) != 0) {
+            send_status(client_socket, request, STATUS_ERROR, 0);
+            return 0;
+        }
+        unsigned long long free_space = get_free_space(client_dir);
+        printf("Free space on path %s: %llu bytes\n", client_dir, free_space);
+
+        // The length is known up front, so check room for all of it (and
+        // keep 10KB spare)
+        if (free_space < (unsigned long long)request->size + 10000) {
+            send_status(client_socket, request, STATUS_NO_SPACE, 0);
+            printf("Not enough disk space for file: %s\n", filename);
+            return 0; // Refused before the content was sent
+        }
+
+        snprintf(client_dir + strlen(client_dir), client_dir_size - strlen(client_dir), "/%s", filename);
+
+        // Hold the file exclusively from truncation until the last byte is written
+        pthread_rwlock_t *lock = lock_file(id, filename, 1);
+
+        // Open the file where content will be written: a fresh upload starts
+        // it over, a resumed one keeps what is stored before its offset
+        FILE *new_file = fopen(client_dir, request->offset > 0 ? "r+b" : "wb");
+        if (new_file == NULL) {
+            int status = request->offset > 0 && errno == ENOENT ? STATUS_BAD_RANGE : STATUS_ERROR;
+            unlock_file(lock);
+            send_status(client_socket, request, status, 0);
+            printf("Could not open file: %s\n", client_dir);
+            return 0;
+        }
+        if (request->offset > 0 && (resume_file(fileno(new_file), request->offset) != 0 || fseeko(new_file, request->offset, SEEK_SET) != 0)) {
+            fclose(new_file);
+            unlock_file(lock);
+            send_status(client_socket, request, STATUS_BAD_RANGE, 0);
+            printf("Cannot resume '%s' at byte %lld.\n", filename, request->offset);
+            return 0;
+        }
+        send_status(client_socket, request, STATUS_OK, 0); // Ready to receive
+
+        int file_fd = fileno(new_file);
+        long long stored = receive_upload(client_socket, new_file, request->offset, request->size, 1, region, file_content);
+
+        // End the file after the last byte stored: a failed write may have
+        // left later chunks behind a gap, and the client resumes from the size
+        if (fflush(new_file) != 0 || ftruncate(file_fd, request->offset + stored) != 0) {
+            stored = -1;
+        }
+        if (fclose(new_file) != 0) {
+            stored = -1;
+        }
+        unlock_file(lock);
+
+        if (stored == request->size) {
+            send_file_status(client_socket, request, STATUS_OK, 0, request->offset + stored);
+            printf("File '%s' uploaded successfully to directory: %s\n", filename, client_dir);
+            return 0;
+        }
+        send_status(client_socket, request, STATUS_ERROR, 0);
+        printf("Upload of '%s' stopped after %lld of %lld bytes.\n", filename, stored, request->size);
+        return -1;
+    } else if (request->opcode == OP_SEGMENT) {
+        if (create_directory_if_not_exists(client_dir) != 0) {
+            send_status(client_socket, request, STATUS_ERROR, 0);
+            return 0;
+        }
+        if (get_free_space(client_dir) < (unsigned long long)request->size + 10000) {
+            send_status(client_socket, request, STATUS_NO_SPACE, 0);
+            printf("Not enough disk space for file: %s\n", filename);
+            return 0;
+        }
+
+        // Segments write disjoint ranges of the staging file, so they need no
+        // file lock; the final file is only touched by the rename
+        int status;
+        int file_fd = open_segment(request, folder_path, &status);
+        FILE *segment = file_fd != -1 ? fdopen(file_fd, "wb") : NULL;
+        if (segment == NULL) {
+            if (file_fd != -1) {
+                close(file_fd);
+                status = STATUS_ERROR;
+            }
+            send_status(client_socket, request, status, 0);
+            printf("Could not open a segment of '%s'.\n", filename);
+            return 0;
+        }
+        if (fseeko(segment, request->offset, SEEK_SET) != 0) {
+            fclose(segment);
+            send_status(client_socket, request, STATUS_ERROR, 0);
+            return 0;
+        }
+        send_status(client_socket, request, STATUS_OK, 0); // Ready to receive
+
+        long long stored = receive_upload(client_socket, segment, request->offset, request->size, 0, region, file_content);
+        if (fclose(segment) != 0) {
+            stored = -1;
+        }
+
+        if (stored == request->size) {
+            int committed = complete_segment(request, folder_path);
+            if (committed >= 0) {
+                send_file_status(client_socket, request, STATUS_OK, 0, request->length);
+                if (committed) {
+                    printf("File '%s' put together from segments in directory: %s\n", filename, client_dir);
+                }
+                return 0;
+            }
+        }
+        send_status(client_socket, request, STATUS_ERROR, 0);
+        printf("Segment of '%s' at byte %lld stopped after %lld of %lld bytes.\n", filename, request->offset, stored, request->size);
+        return stored == request->size ? 0 : -1;
+    } else if (request->opcode == OP_DOWNLOAD) {
+        FILE *file_to_send;
+        struct stat file_stat;
+        int bytes_read;
+
+        // Construct the full path to the file
+        snprintf(client_dir, client_dir_size, "%s/%s/%s", folder_path, id, filename);
+
+        // Readers share the file, an upload of it waits until they finish
+        pthread_rwlock_t *lock = lock_file(id, filename, 0);
+
+        // Open the file
+        file_to_send = fopen(client_dir, "rb"); // Use "rb" for reading binary files
+        if (file_to_send == NULL || fstat(fileno(file_to_send), &file_stat) != 0) {
+            if (file_to_send) {
+                fclose(file_to_send);
+            }
+            unlock_file(lock);
+            send_status(client_socket, request, STATUS_NOT_FOUND, 0);
+            printf("File '%s' not found in directory '%s'.\n", filename, client_dir);
+            return 0;
+        }
+
+        // The range runs from the offset for the asked length, or to the end
+        if (request->offset > file_stat.st_size) {
+            fclose(file_to_send);
+            unlock_file(lock);
+            send_file_status(client_socket, request, STATUS_BAD_RANGE, 0, file_stat.st_size);
+            return 0;
+        }
+        long long length = file_stat.st_size - request->offset;
+        if (request->length > 0 && request->length < length) {
+            length = request->length;
+        }
+
+        // Cork the socket so the header leaves in the same segment as the
+        // first bytes of content instead of as a packet of its own
+        int cork = 1;
+        setsockopt(client_socket, IPPROTO_TCP, TCP_CORK, &cork, sizeof(cork));
+
+        send_file_status(client_socket, request, STATUS_OK, length, file_stat.st_size);
+
+        // Send the file content to the client. The bytes go out as stored, so
+        // the zero-copy path applies whenever the kernel supports it.
+        int file_fd = fileno(file_to_send);
+        long long sent = -1;
+        if (use_zero_copy) {
+            sent = sendfile_download(client_socket, file_fd, request->offset, length);
+        }
+        if (sent < 0 && transfer_ring != NULL) {
+            sent = uring_download(transfer_ring, client_socket, file_fd, request->offset, length);
+        }
+        if (sent < 0 && fseeko(file_to_send, request->offset, SEEK_SET) == 0) {
+            sent = 0;
+            while (sent < length) {
+                size_t want = length - sent < BUFFER_SIZE ? (size_t)(length - sent) : BUFFER_SIZE;
+                if ((bytes_read = fread(file_content, 1, want, file_to_send)) <= 0 ||
+                    send_all(client_socket, file_content, bytes_read) != 0) {
+                    break;
+                }
+                sent += bytes_read;
+                yield_to_small_jobs();
+            }
+        }
+
+        cork = 0; // Flush whatever is still held back
+        setsockopt(client_socket, IPPROTO_TCP, TCP_CORK, &cork, sizeof(cork));
+
+        fclose(file_to_send);
+        unlock_file(lock);
+        if (sent != length) {
+            printf("Download of '%s' stopped after %lld of %lld bytes.\n", filename, sent, length);
+            return -1;
+        }
+        printf("File '%s' sent to client from directory '%s'.\n", filename, client_dir);
+        return 0;
+    } else if (request->opcode == OP_VIEW) {
+        size_t length;
+
+        char *listing = format_listing(client_dir, region, &length);
+
+        if (listing == NULL) {
+            send_status(client_socket, request, STATUS_NOT_FOUND, 0);
+            return 0;
+        }
+
+        // Header and listing leave in one write
+        MessageHeader header = {.opcode = OP_VIEW, .status = STATUS_OK, .payload_length = length, .request_id = request->request_id};
+        protocol_encode(&header, (unsigned char *)listing);
+        return send_all(client_socket, listing, PROTOCOL_HEADER_SIZE + length);
+    } else if (request->opcode == OP_STAT) {
+        struct stat file_stat;
+
+        // The size of a partial upload tells the client where to resume
+        snprintf(client_dir, client_dir_size, "%s/%s/%s", folder_path, id, filename);
+        pthread_rwlock_t *lock = lock_file(id, filename, 0);
+        int found = stat(client_dir, &file_stat) == 0;
+        unlock_file(lock);
+
+        if (!found) {
+            send_status(client_socket, request, STATUS_NOT_FOUND, 0);
+            return 0;
+        }
+        return send_file_status(client_socket, request, STATUS_OK, 0, file_stat.st_size);
+    }
+    return 0;
+}
+
+// Expected cost of a request, from the size of the range for downloads and
+// the announced length for uploads. path is scratch space.
+enum job_class classify_request(const struct request *request, const char *folder_path, char *path, size_t path_size) {
+    struct stat file_stat;
+    long long size = -1;
+
+    if (request->opcode == OP_DOWNLOAD) {
+        snprintf(path, path_size, "%s/%s/%s", folder_path, request->id, request->filename);
+        if (stat(path, &file_stat) == 0) {
+            size = file_stat.st_size - request->offset; // Only the range is sent
+            if (request->length > 0 && request->length < size) {
+                size = request->length;
+            }
+        }
+    } else if (request->opcode == OP_UPLOAD || request->opcode == OP_SEGMENT) {
+        size = request->size;
+    } else {
+        return JOB_VIEW;
+    }
+    return size >= 0 && size <= small_job_bytes ? JOB_SMALL : JOB_LARGE;
+}
+
+// Close a connection and return its state to the pool
+void finish_connection(struct client_info *info) {
+    close(info->client_socket);
+    region_destroy(&info->region);
+    construct_client_info(info);
+    slab_free(&client_info_slab, info);
+}
+
+// Connections with no request in sight wait here, registered one-shot, so
+// an idle client holds no worker. The poller hands a connection to intake
+// once its next request starts to arrive, and intake returns it here while
+// only part of the header and name has come; a worker never blocks waiting
+// for a client that has not sent its whole request yet.
+int idle_epoll = -1;
+
+// Connections registered with idle_epoll, so the poller can close those that
+// stay silent, or stall partway through a request, past their deadline
+struct client_info *idle_connections = NULL;
+pthread_mutex_t idle_lock = PTHREAD_MUTEX_INITIALIZER;
+long long idle_timeout_ms = DEFAULT_IDLE_TIMEOUT * 1000LL;
+
+long long monotonic_ms(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000LL + now.tv_nsec / 1000000;
+}
+
+// Both with idle_lock held
+static void list_idle(struct client_info *info) {
+    info->idle_next = idle_connections;
+    if (idle_connections != NULL) {
+        idle_connections->idle_link = &info->idle_next;
+    }
+    idle_connections = info;
+    info->idle_link = &idle_connections;
+}
+
+static void unlist_idle(struct client_info *info) {
+    if (info->idle_link == NULL) {
+        return;
+    }
+    *info->idle_link = info->idle_next;
+    if (info->idle_next != NULL) {
+        info->idle_next->idle_link = info->idle_link;
+    }
+    info->idle_next = NULL;
+    info->idle_link = NULL;
+}
+
+// Close every watched connection past its deadline. Only the poller calls
+// this, and a connection it watches belongs to no worker, so nothing else
+// can be using one it closes.
+static void close_stalled_connections(long long now) {
+    pthread_mutex_lock(&idle_lock);
+    struct client_info *info = idle_connections;
+    while (info != NULL) {
+        struct client_info *next = info->idle_next;
+        if (info->idle_deadline <= now) {
+            unlist_idle(info);
+            epoll_ctl(idle_epoll, EPOLL_CTL_DEL, info->client_socket, NULL);
+            if (info->partial_length > 0) {
+                printf("Closing a connection stalled partway through its request.\n");
+            }
+            finish_connection(info);
+        }
+        info = next;
+    }
+    pthread_mutex_unlock(&idle_lock);
+}
+
+void *poll_idle_connections(void *arg) {
+    struct epoll_event events[MAX_EVENTS];
+    long long next_sweep = monotonic_ms() + IDLE_SWEEP_MS;
+    (void)arg;
+
+    while (1) {
+        int ready = epoll_wait(idle_epoll, events, MAX_EVENTS, IDLE_SWEEP_MS);
+        if (ready == -1) {
+            if (errno == EINTR) continue;
+            perror("epoll_wait failed");
+            return NULL;
+        }
+
+        // Off the list before a worker can have them back
+        pthread_mutex_lock(&idle_lock);
+        for (int i = 0; i < ready; i++) {
+            unlist_idle(events[i].data.ptr);
+        }
+        pthread_mutex_unlock(&idle_lock);
+        for (int i = 0; i < ready; i++) {
+            scheduler_submit(&scheduler, events[i].data.ptr);
+        }
+
+        long long now = monotonic_ms();
+        if (now >= next_sweep) {
+            close_stalled_connections(now);
+            next_sweep = now + IDLE_SWEEP_MS;
+        }
+    }
+}
+
+// Send a connection to intake once its next request arrives. A connection
+// gets idle_timeout_ms to start each request, and as long again to finish
+// its header and name once they start coming (see intake_request).
+void await_request(struct client_info *info) {
+    char next;
+
+    if (info->partial_length == 0) {
+        info->idle_deadline = monotonic_ms() + idle_timeout_ms;
+    } else if (monotonic_ms() >= info->idle_deadline) {
+        // Trickling in too slowly to ever wait in the poller
+        printf("Closing a connection stalled partway through its request.\n");
+        finish_connection(info);
+        return;
+    }
+
+    // A request that is already here (pipelined, or sent with the
+    // connection) goes straight to intake
+    ssize_t peeked = recv(info->client_socket, &next, 1, MSG_PEEK | MSG_DONTWAIT);
+    if (peeked > 0) {
+        scheduler_submit(&scheduler, info);
+        return;
+    }
+    if (peeked == 0) {
+        finish_connection(info); // The client is done
+        return;
+    }
+
+    // Listed before it is armed: once armed, the poller may take it at once
+    struct epoll_event event;
+    event.events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT;
+    event.data.ptr = info;
+    pthread_mutex_lock(&idle_lock);
+    list_idle(info);
+    if (epoll_ctl(idle_epoll, EPOLL_CTL_MOD, info->client_socket, &event) == -1 &&
+        (errno != ENOENT || epoll_ctl(idle_epoll, EPOLL_CTL_ADD, info->client_socket, &event) == -1)) {
+        perror("Failed to watch idle connection");
+        unlist_idle(info);
+        pthread_mutex_unlock(&idle_lock);
+        finish_connection(info);
+        return;
+    }
+    pthread_mutex_unlock(&idle_lock);
+}
+
+// Ready a served connection for its next request
+void continue_connection(struct client_info *info) {
+    region_reset(&info->region); // Drop the last request's buffers
+    info->request = NULL;
+    await_request(info);
+}
+
+// Connections switched to multiplexing in threads mode are served by an
+// event loop thread of their own: the worker that read the MULTIPLEX
+// request queues the socket (plus one, so it is never NULL) and signals
+// handoff_event, and the loop adopts it
+Queue handoff_queue;
+int handoff_event = -1;
+static char handoff_marker; // Epoll entry of handoff_event
+
+void hand_off_multiplexed(struct client_info *info) {
+    int client_socket = info->client_socket;
+    uint64_t signal_value = 1;
+
+    release_request(); // Its streams are the loop's work, not the workers'
+    if (send_status(client_socket, info->request, STATUS_OK, 0) != 0) {
+        finish_connection(info);
+        return;
+    }
+    epoll_ctl(idle_epoll, EPOLL_CTL_DEL, client_socket, NULL); // Watched by the loop from now on
+
+    region_destroy(&info->region);
+    construct_client_info(info);
+    slab_free(&client_info_slab, info);
+    enqueue(&handoff_queue, (void *)(intptr_t)(client_socket + 1));
+    if (write(handoff_event, &signal_value, sizeof(signal_value)) != sizeof(signal_value)) {
+        perror("Failed to signal the multiplexing loop");
+    }
+}
+
+// Receive what has arrived of the next request's header and the name it
+// announces into info->partial, without waiting for the rest. Returns 1 once
+// both are in, 0 while more is still to come, -1 if the client closed the
+// connection or sent a malformed header.
+static int receive_request(struct client_info *info, MessageHeader *header) {
+    size_t wanted = PROTOCOL_HEADER_SIZE;
+
+    while (1) {
+        if (info->partial_length >= PROTOCOL_HEADER_SIZE) {
+            if (protocol_decode(info->partial, header) != 0 || header->name_length > PROTOCOL_NAME_MAX) {
+                return -1;
+            }
+            wanted = PROTOCOL_HEADER_SIZE + header->name_length;
+            if (info->partial_length == wanted) {
+                return 1;
+            }
+        }
+        ssize_t received = recv(info->client_socket, info->partial + info->partial_length, wanted - info->partial_length, MSG_DONTWAIT);
+        if (received < 0) {
+            if (errno == EINTR) continue;
+            return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+        }
+        if (received == 0) {
+            return -1;
+        }
+        info->partial_length += received;
+    }
+}
+
+// Intake: receive and decode the next request, then queue it under its ID
+void intake_request(struct client_info *info) {
+    struct request malformed = {.opcode = OP_NONE};
+    MessageHeader header;
+
+    // A request that has only partly arrived goes back to the idle poller
+    // with what came so far, so a slow or stalled client never holds a
+    // worker while the rest is on its way
+    size_t had = info->partial_length;
+    int received = receive_request(info, &header);
+    if (received == 0) {
+        if (had == 0 && info->partial_length > 0) {
+            info->idle_deadline = monotonic_ms() + idle_timeout_ms; // Its time to finish starts now
+        }
+        await_request(info);
+        return;
+    }
+    if (received < 0 && info->partial_length == 0) {
+        finish_connection(info); // Closed between requests
+        return;
+    }
+    if (received < 0) {
+        printf("Client disconnected or sent a malformed request.\n");
+        send_status(info->client_socket, &malformed, STATUS_BAD_REQUEST, 0);
+        finish_connection(info);
+        return;
+    }
+    info->partial_length = 0; // The next request starts afresh
+
+    // Buffers for the classification path and the request, only taken once
+    // the request is complete
+    char *line = region_alloc(&info->region, BUFFER_SIZE);
+    info->request = region_zalloc(&info->region, sizeof(struct request));
+    if (!line || !info->request) {
+        printf("Could not allocate request buffers.\n");
+        finish_connection(info);
+        return;
+    }
+    if (decode_request(&header, (const char *)info->partial + PROTOCOL_HEADER_SIZE, info->request) != STATUS_OK) {
+        // Nothing beyond the name was sent, so the connection stays usable
+        send_status(info->client_socket, info->request, STATUS_BAD_REQUEST, 0);
+        continue_connection(info);
+        return;
+    }
+
+    // Shed load before it reaches the workers. The slot is held until
+    // serve_next has served the request.
+    int retry_after = admit_request(scheduler_pending(&scheduler) + scheduler_pending(&small_lane));
+    if (retry_after) {
+        reject_busy(info->client_socket, retry_after);
+        finish_connection(info);
+        return;
+    }
+    if (info->request->opcode == OP_MULTIPLEX) {
+        hand_off_multiplexed(info);
+        return;
+    }
+
+    info->small = classify_request(info->request, info->folder_path, line, BUFFER_SIZE) != JOB_LARGE;
+    if (info->small) {
+        atomic_fetch_add(&small_jobs, 1);
+    }
+    if (fair_submit(info->small ? &small_queue : &fair_queue, info->request->id, &info->fair) != 0) {
+        if (info->small) {
+            atomic_fetch_sub(&small_jobs, 1);
+        }
+        release_request();
+        finish_connection(info);
+        return;
+    }
+    scheduler_submit(info->small ? &small_lane : &scheduler, &dispatch_token);
+}
+
+// Serve the next request of queue in fair order. Returns 0 if nothing could
+// be taken, 1 otherwise.
+int serve_next(FairQueue *queue, Scheduler *lane) {
+    FairItem *item = fair_next(queue);
+    if (item == NULL) {
+        return 0; // Every waiting ID is at its cap; a completion dispatches again
+    }
+
+    struct client_info *info = (struct client_info *)item;
+    int small = info->small;
+    serving_large = !small;
+    int keep_alive = process_file(info->request, info->client_socket, info->folder_path, &info->region) == 0;
+    serving_large = 0;
+    release_request();
+
+    // Complete before the connection can be queued again with its next request
+    int waiting = fair_complete(queue, item);
+    if (keep_alive) {
+        continue_connection(info);
+    } else {
+        finish_connection(info);
+    }
+    if (small) {
+        atomic_fetch_sub(&small_jobs, 1);
+    }
+    if (waiting) {
+        scheduler_submit(lane, &dispatch_token);
+    }
+    return 1;
+}
+
+// Dispatch on a bulk worker: small jobs first, then the bulk queue
+void dispatch_request(void) {
+    if (atomic_load(&small_jobs) > 0 && serve_next(&small_queue, &small_lane)) {
+        // This token's own request is still queued
+        scheduler_submit(&scheduler, &dispatch_token);
+        return;
+    }
+    serve_next(&fair_queue, &scheduler);
+}
+
+// Scheduler items are connections with a request arriving, or dispatch tokens
+void handle_client(void *arg) {
+    if (arg == &dispatch_token) {
+        dispatch_request();
+    } else {
+        intake_request((struct client_info *)arg);
+    }
+}
+
+// The small-job lane only sees dispatch tokens
+void handle_small_job(void *arg) {
+    (void)arg;
+    serve_next(&small_queue, &small_lane);
+}
+
+// Runs once on each worker thread before it takes connections
+void init_worker(int worker) {
+    static __thread Uring ring;
+    (void)worker;
+
+    // Each worker owns a ring; without one its transfers use the copy loops
+    if (use_uring && uring_init(&ring) == 0) {
+        transfer_ring = &ring;
+    }
+}
+
+// Event loop mode: one thread drives every connection through edge-triggered
+// epoll. Each connection is a small state machine that runs until its socket
+// would block and picks up again on the next readiness event.
+enum connection_state {
+    STATE_READ_HEADER,  // Receiving the request header
+    STATE_READ_NAME,    // Receiving the file name it announces
+    STATE_LOCK,         // Request decoded, taking its file lock
+    STATE_SEND_REPLY,   // Flushing a reply, then moving to next_state
+    STATE_UPLOAD,       // Receiving file content into file_fd
+    STATE_COMMIT,       // Segment stored, renaming the completed file into place
+    STATE_DOWNLOAD,     // Streaming file_fd to the client
+    STATE_FINISHED,     // Request served, wait for the next one
+    STATE_MULTIPLEXED,  // Carrying streams of frames, see advance_multiplexed
+    STATE_CLOSE         // Done, close the connection
+};
+
+// Where a multiplexed connection is in the frame it is receiving
+enum frame_stage {
+    FRAME_HEADER,
+    FRAME_NAME,
+    FRAME_DATA
+};
+
+// One request of a multiplexed connection. Its content moves in DATA frames
+// of at most PROTOCOL_FRAME_MAX bytes and only as far as the receiver's
+// window allows, so a large transfer takes turns with the others instead of
+// holding them up.
+struct stream {
+    int active;
+    uint32_t id;                      // Request ID that opened it
+    int opcode;
+    int file_fd;                      // Upload target or download source, -1 once done or failed
+    char *listing;                    // View content, PROTOCOL_HEADER_SIZE bytes in
+    size_t listing_sent;
+    long long remaining;              // Content still to move
+    long long send_window;            // Bytes we may still send (downloads and views)
+    long long recv_window;            // Bytes the client may still send (uploads)
+    long long grant;                  // Upload bytes stored but not yet granted back
+    int reply_pending;                // Reply still to send
+    MessageHeader reply;
+    struct request request;
+    char *path;                       // Client directory, then the file path
+    char *staging;                    // Where a fresh upload is written until it moves into place
+    pthread_rwlock_t *lock;           // File stripe held while the stream reads or resumes the file
+    int waiting;                      // Opening (downloads, stats) or committing (uploads)
+                                      // waits until the file's stripe is free
+    Region region;                    // Path and listing of this stream
+};
+
+struct connection {
+    int socket;
+    enum connection_state state;
+    enum connection_state next_state; // Where STATE_SEND_REPLY goes once flushed
+    int file_fd;                      // Upload target or download source
+    pthread_rwlock_t *lock;           // File stripe held for the transfer, see lock_request
+    int admitted;                     // The request holds an admission slot
+    MessageHeader header;             // Request being received
+    struct request *request;
+    char *client_dir;                 // Client directory, then the file path
+    char *in;                         // Request header and name, then upload chunks
+    size_t in_len;                    // Bytes of the header or name received so far
+    long long remaining;              // Content still to move for an upload or download
+    long long file_size;              // Full size of the file, reported in replies
+    char *out;                        // Pending output
+    size_t out_len;
+    size_t out_sent;
+    Region region;                    // Buffers of this connection
+    struct stream *streams;           // PROTOCOL_MAX_STREAMS slots once multiplexed
+    int next_stream;                  // Slot whose turn it is to send a frame
+    enum frame_stage frame_stage;
+    long long frame_left;             // DATA bytes of the current frame still to receive
+    struct stream *frame_stream;      // Where they go, NULL to drop them
+    int waiting;                      // On waiting_connections
+    struct connection *next_waiting;
+};
+
+// Pool of connection objects for the event loop
+Slab connection_slab;
+
+void construct_connection(void *object) {
+    struct connection *conn = (struct connection *)object;
+    memset(conn, 0, sizeof(struct connection));
+    conn->socket = -1;
+    conn->file_fd = -1;
+}
+
+int set_nonblocking(int fd) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    return flags == -1 ? -1 : fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+// Replies are single writes (downloads cork their own), so Nagle would only
+// hold back the next pipelined reply until the client's delayed ACK
+void set_nodelay(int socket) {
+    int nodelay = 1;
+    setsockopt(socket, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+}
+
+// The event loop never waits for a file lock (see try_lock_file). A
+// connection whose request or stream found its file's stripe taken goes on
+// this list, and the loop tries it again every LOCK_RETRY_MS until the
+// stripe is free. Only the loop's thread touches it.
+#define LOCK_RETRY_MS 10
+struct connection *waiting_connections = NULL;
+
+void wait_for_lock(struct connection *conn) {
+    if (!conn->waiting) {
+        conn->waiting = 1;
+        conn->next_waiting = waiting_connections;
+        waiting_connections = conn;
+    }
+}
+
+void close_stream(struct stream *stream) {
+    if (stream->file_fd != -1) {
+        close(stream->file_fd);
+    }
+    if (stream->staging != NULL) {
+        unlink(stream->staging); // The upload never completed
+    }
+    if (stream->lock != NULL) {
+        unlock_file(stream->lock);
+    }
+    if (stream->waiting && stream->opcode == OP_SEGMENT) {
+        abandon_segment(&stream->request);
+    }
+    region_destroy(&stream->region);
+    memset(stream, 0, sizeof(struct stream));
+    stream->file_fd = -1;
+}
+
+void release_request_lock(struct connection *conn) {
+    if (conn->lock != NULL) {
+        unlock_file(conn->lock);
+        conn->lock = NULL;
+    }
+}
+
+void release_admission(struct connection *conn) {
+    if (conn->admitted) {
+        release_request();
+        conn->admitted = 0;
+    }
+}
+
+void close_connection(struct connection *conn) {
+    if (conn->file_fd != -1) {
+        close(conn->file_fd);
+    }
+    release_request_lock(conn);
+    release_admission(conn);
+    if (conn->state == STATE_COMMIT) {
+        abandon_segment(conn->request);
+    }
+    if (conn->waiting) {
+        struct connection **link = &waiting_connections;
+        while (*link != conn) {
+            link = &(*link)->next_waiting;
+        }
+        *link = conn->next_waiting;
+    }
+    for (int i = 0; conn->streams != NULL && i < PROTOCOL_MAX_STREAMS; i++) {
+        if (conn->streams[i].active) {
+            close_stream(&conn->streams[i]);
+        }
+    }
+    close(conn->socket); // Also drops it from the epoll set
+    region_destroy(&conn->region);
+    construct_connection(conn);
+    slab_free(&connection_slab, conn);
+}
+
+// Drop the served request's buffers and file and wait for the next request.
+// Returns -1 if the request buffers cannot be set up again.
+int reset_connection(struct connection *conn) {
+    if (conn->file_fd != -1) {
+        close(conn->file_fd);
+        conn->file_fd = -1;
+    }
+    release_request_lock(conn);
+    release_admission(conn);
+    region_reset(&conn->region); // Keeps the block the request buffers live in
+    conn->in = region_alloc(&conn->region, BUFFER_SIZE);
+    conn->out = region_alloc(&conn->region, BUFFER_SIZE * 2);
+    memset(&conn->header, 0, sizeof(conn->header));
+    conn->request = NULL;
+    conn->client_dir = NULL;
+    conn->in_len = 0;
+    conn->remaining = 0;
+    conn->file_size = 0;
+    conn->out_len = conn->out_sent = 0;
+    conn->state = STATE_READ_HEADER;
+    return conn->in && conn->out ? 0 : -1;
+}
+
+// Queue a reply header and continue in next_state once it is sent
+void send_reply(struct connection *conn, int status, unsigned long long payload_length, enum connection_state next_state) {
+    MessageHeader header = {
+        .opcode = conn->header.opcode,
+        .status = status,
+        .payload_length = payload_length,
+        .request_id = conn->header.request_id,
+        .offset = conn->header.offset,
+        .length = conn->file_size,
+    };
+
+    protocol_encode(&header, (unsigned char *)conn->out);
+    conn->out_len = PROTOCOL_HEADER_SIZE;
+    conn->out_sent = 0;
+    conn->state = STATE_SEND_REPLY;
+    conn->next_state = next_state;
+}
+
+// Send as much pending output as the socket takes. Returns 1 when all of it
+// is out, 0 if the socket is full, -1 on error.
+int flush_output(struct connection *conn) {
+    while (conn->out_sent < conn->out_len) {
+        ssize_t sent = send(conn->socket, conn->out + conn->out_sent, conn->out_len - conn->out_sent, MSG_NOSIGNAL);
+        if (sent < 0) {
+            if (errno == EINTR) continue;
+            return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+        }
+        conn->out_sent += sent;
+    }
+    conn->out_len = conn->out_sent = 0;
+    return 1;
+}
+
+// Receive into conn->in until it holds length bytes. Returns 1 once it does,
+// 0 if the socket has nothing more for now, -1 on error or disconnect.
+int fill_input(struct connection *conn, size_t length) {
+    while (conn->in_len < length) {
+        ssize_t received = recv(conn->socket, conn->in + conn->in_len, length - conn->in_len, 0);
+        if (received < 0) {
+            if (errno == EINTR) continue;
+            return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+        }
+        if (received == 0) {
+            int between_requests = conn->state == STATE_READ_HEADER || (conn->state == STATE_MULTIPLEXED && conn->frame_stage == FRAME_HEADER);
+            if (conn->in_len > 0 || !between_requests) {
+                printf("Client disconnected or error receiving data.\n");
+            }
+            return -1; // Otherwise closed cleanly between requests
+        }
+        conn->in_len += received;
+    }
+    return 1;
+}
+
+struct stream *find_stream(struct connection *conn, uint32_t id) {
+    for (int i = 0; i < PROTOCOL_MAX_STREAMS; i++) {
+        if (conn->streams[i].active && conn->streams[i].id == id) {
+            return &conn->streams[i];
+        }
+    }
+    return NULL;
+}
+
+// Queue the stream's reply header; it goes out on the stream's next turn
+void stream_reply(struct stream *stream, int status, unsigned long long payload_length) {
+    stream->reply_pending = 1;
+    stream->reply.status = status;
+    stream->reply.payload_length = payload_length;
+}
+
+// Give the connection its stream slots and frame-sized buffers. Returns -1
+// if they cannot be allocated.
+int switch_to_multiplexed(struct connection *conn) {
+    struct stream *streams = region_zalloc(&conn->region, PROTOCOL_MAX_STREAMS * sizeof(struct stream));
+    char *in = region_alloc(&conn->region, PROTOCOL_FRAME_MAX);
+    char *out = region_alloc(&conn->region, PROTOCOL_HEADER_SIZE + PROTOCOL_FRAME_MAX);
+    if (!streams || !in || !out) {
+        return -1; // The request buffers stay in place for the error reply
+    }
+    conn->streams = streams;
+    conn->in = in;
+    conn->out = out;
+    for (int i = 0; i < PROTOCOL_MAX_STREAMS; i++) {
+        conn->streams[i].file_fd = -1;
+    }
+    conn->in_len = 0;
+    conn->out_len = conn->out_sent = 0;
+    conn->frame_stage = FRAME_HEADER;
+    return 0;
+}
+
+// Put a complete upload in place: rename its staging file, or the segmented
+// file it completed, over the final one under the file's write lock. If the
+// stripe is taken the stream waits and this is tried again.
+void commit_upload_stream(struct stream *stream, const char *folder_path) {
+    int status = STATUS_OK;
+
+    pthread_rwlock_t *lock = try_lock_file(stream->request.id, stream->request.filename, 1);
+    if (lock == NULL) {
+        stream->waiting = 1;
+        return;
+    }
+    if (stream->opcode == OP_SEGMENT) {
+        if (commit_segment(&stream->request, folder_path) < 0) {
+            status = STATUS_ERROR;
+        }
+    } else if (rename(stream->staging, stream->path) == 0) {
+        stream->staging = NULL;
+    } else {
+        status = STATUS_ERROR;
+    }
+    unlock_file(lock);
+    stream_reply(stream, status, 0);
+}
 
-// Structure for managing memory blocks
-typedef struct MemoryBlock {
-    size_t size;              // Size of the block
-    int is_free;              // Is the block free?
-    struct MemoryBlock *next; // Pointer to the next block
-} MemoryBlock;
+// An upload stream has stored its last byte: close the file and put it in
+// place, or for a segment record it, which may complete the whole file
+void finish_upload_stream(struct stream *stream, const char *folder_path) {
+    close(stream->file_fd);
+    stream->file_fd = -1;
+    if (stream->opcode == OP_SEGMENT) {
+        int recorded = record_segment(&stream->request);
+        if (recorded != 1) {
+            stream_reply(stream, recorded < 0 ? STATUS_ERROR : STATUS_OK, 0);
+            return;
+        }
+    } else if (stream->staging == NULL) {
+        unlock_file(stream->lock); // Resumed in place, under the lock all along
+        stream->lock = NULL;
+        stream_reply(stream, STATUS_OK, 0);
+        return;
+    }
+    commit_upload_stream(stream, folder_path);
+}
 
-static void *arena = NULL;       // Memory arena
-static MemoryBlock *free_list = NULL; // List of free blocks
-pthread_mutex_t memory_mutex;    // Mutex for thread-safe memory operations
+// Open what a download, stat or view stream reads; downloads and stats take
+// the file's shared lock like a worker does. If the stripe is taken the
+// stream waits and this is tried again.
+void start_stream(struct stream *stream) {
+    struct request *request = &stream->request;
 
-// Helper function to align sizes
-size_t align_size(size_t size) {
-    return (size + (ALIGNMENT - 1)) & ~(ALIGNMENT - 1);
-}
+    if (request->opcode == OP_DOWNLOAD) {
+        struct stat file_stat;
 
-// Initialize the arena
-void initialize_arena() {
-    if (!arena) {
-        arena = malloc(ARENA_SIZE);
-        if (!arena) {
-            fprintf(stderr, "Failed to allocate memory arena.\n");
-            exit(EXIT_FAILURE);
+        // Held until the stream closes, so no upload rewrites the file under it
+        stream->lock = try_lock_file(request->id, request->filename, 0);
+        if (stream->lock == NULL) {
+            stream->waiting = 1;
+            return;
         }
+        stream->file_fd = open(stream->path, O_RDONLY);
+        if (stream->file_fd == -1 || fstat(stream->file_fd, &file_stat) != 0) {
+            stream_reply(stream, STATUS_NOT_FOUND, 0);
+            printf("File '%s' not found in directory '%s'.\n", request->filename, stream->path);
+            return;
+        }
+        stream->reply.length = file_stat.st_size;
+        if (request->offset > file_stat.st_size || lseek(stream->file_fd, request->offset, SEEK_SET) != request->offset) {
+            stream_reply(stream, STATUS_BAD_RANGE, 0);
+            return;
+        }
+        stream->remaining = file_stat.st_size - request->offset;
+        if (request->length > 0 && request->length < stream->remaining) {
+            stream->remaining = request->length;
+        }
+        stream->send_window = PROTOCOL_WINDOW;
+        stream_reply(stream, STATUS_OK, stream->remaining);
+    } else if (request->opcode == OP_STAT) {
+        struct stat file_stat;
 
-        // Initialize the free list with a single large block
-        free_list = (MemoryBlock *)arena;
-        free_list->size = ARENA_SIZE - sizeof(MemoryBlock);
-        free_list->is_free = 1;
-        free_list->next = NULL;
-
-        pthread_mutex_init(&memory_mutex, NULL);
-        printf("Memory arena initialized with size: %d bytes\n", ARENA_SIZE);
-    }
-}
-void calculate_arena_space(size_t *used_space, size_t *free_space) {
-    *used_space = 0;
-    *free_space = 0;
+        pthread_rwlock_t *lock = try_lock_file(request->id, request->filename, 0);
+        if (lock == NULL) {
+            stream->waiting = 1;
+            return;
+        }
+        int found = stat(stream->path, &file_stat) == 0;
+        unlock_file(lock);
+        if (!found) {
+            stream_reply(stream, STATUS_NOT_FOUND, 0);
+            return;
+        }
+        stream->reply.length = file_stat.st_size;
+        stream_reply(stream, STATUS_OK, 0);
+    } else {
+        size_t length;
 
-    MemoryBlock *current = (MemoryBlock *)arena;
-    while ((void *)current < (void *)((char *)arena + ARENA_SIZE)) {
-        if (current->is_free) {
-            *free_space += current->size;
-        } else {
-            *used_space += current->size;
+        stream->listing = format_listing(stream->path, &stream->region, &length);
+        if (stream->listing == NULL) {
+            stream_reply(stream, STATUS_NOT_FOUND, 0);
+            return;
         }
-        if (!current->next) break;
-        current = current->next;
+        stream->remaining = length;
+        stream->send_window = PROTOCOL_WINDOW;
+        stream_reply(stream, STATUS_OK, length);
     }
 }
 
-void print_arena_space() {
-    size_t used_space, free_space;
-    calculate_arena_space(&used_space, &free_space);
-    printf("Arena Space: Used = %zu bytes, Free = %zu bytes\n", used_space, free_space);
+// Try again whatever the stream was waiting for its file's stripe to do
+void retry_stream(struct stream *stream, const char *folder_path) {
+    stream->waiting = 0;
+    if (is_upload(stream->opcode)) {
+        commit_upload_stream(stream, folder_path);
+    } else {
+        start_stream(stream);
+    }
 }
-// Custom malloc implementation
-void *mymalloc(size_t size) {
-    pthread_mutex_lock(&memory_mutex);
 
-    size = align_size(size); // Align the requested size
-    MemoryBlock *current = free_list;
-    MemoryBlock *prev = NULL;
+// Open a stream for the request in conn->header and conn->in. Failures the
+// client can be told about become the stream's reply; returns -1 only when
+// the client broke the stream rules and the connection must close.
+int open_stream(struct connection *conn, const char *folder_path) {
+    struct stream *stream = NULL;
+    size_t path_size = FILE_PATH_BUFFER_SIZE * 3;
 
-    // Find a free block that fits the requested size
-    while (current && (!current->is_free || current->size < size)) {
-        prev = current;
-        current = current->next;
+    for (int i = 0; i < PROTOCOL_MAX_STREAMS; i++) {
+        if (conn->streams[i].active && conn->streams[i].id == conn->header.request_id) {
+            return -1; // Still in use
+        }
+        if (!conn->streams[i].active && stream == NULL) {
+            stream = &conn->streams[i];
+        }
     }
-
-    if (!current) {
-        pthread_mutex_unlock(&memory_mutex);
-        return NULL; // No suitable block found
+    if (stream == NULL) {
+        return -1; // Over PROTOCOL_MAX_STREAMS
+    }
+    stream->active = 1;
+    stream->id = conn->header.request_id;
+    stream->opcode = conn->header.opcode;
+    stream->reply.opcode = conn->header.opcode;
+    stream->reply.request_id = conn->header.request_id;
+    stream->reply.offset = conn->header.offset;
+    region_init(&stream->region, BUFFER_SIZE * 8);
+    stream->path = region_alloc(&stream->region, path_size);
+    if (stream->path == NULL) {
+        stream_reply(stream, STATUS_ERROR, 0);
+        return 0;
+    }
+    if (decode_request(&conn->header, conn->in, &stream->request) != STATUS_OK || stream->opcode == OP_MULTIPLEX) {
+        stream_reply(stream, STATUS_BAD_REQUEST, 0);
+        return 0;
     }
 
-    // Split the block if there's enough space for another block
-    if (current->size > size + sizeof(MemoryBlock)) {
-        MemoryBlock *new_block = (MemoryBlock *)((char *)current + sizeof(MemoryBlock) + size);
-        new_block->size = current->size - size - sizeof(MemoryBlock);
-        new_block->is_free = 1;
-        new_block->next = current->next;
+    struct request *request = &stream->request;
+    snprintf(stream->path, path_size, "%s/%s", folder_path, request->id);
 
-        current->size = size;
-        current->next = new_block;
+    if (!is_upload(request->opcode)) {
+        if (request->opcode != OP_VIEW) {
+            snprintf(stream->path + strlen(stream->path), path_size - strlen(stream->path), "/%s", request->filename);
+        }
+        start_stream(stream);
+        return 0;
     }
 
-    current->is_free = 0;
-    printf("\nAfter mymalloc: \n");
-    print_arena_space();
-    pthread_mutex_unlock(&memory_mutex);
-
-    return (char *)current + sizeof(MemoryBlock);
+    int status;
+    if (create_directory_if_not_exists(stream->path) != 0) {
+        stream_reply(stream, STATUS_ERROR, 0);
+        return 0;
+    }
+    if (get_free_space(stream->path) < (unsigned long long)request->size + 10000) { // Room for the file and 10KB spare
+        stream_reply(stream, STATUS_NO_SPACE, 0);
+        printf("Not enough disk space for file: %s\n", request->filename);
+        return 0;
+    }
+    snprintf(stream->path + strlen(stream->path), path_size - strlen(stream->path), "/%s", request->filename);
+    if (request->opcode == OP_SEGMENT) {
+        stream->file_fd = open_segment(request, folder_path, &status);
+        if (stream->file_fd == -1) {
+            stream_reply(stream, status, 0);
+            printf("Could not open a segment of '%s'.\n", request->filename);
+            return 0;
+        }
+        stream->reply.length = request->length;
+    } else if (request->offset > 0) {
+        // A resumed upload extends the file in place, so it holds the file
+        // exclusively throughout. Its DATA is already on the way and cannot
+        // wait for the stripe, so a taken stripe turns it away instead.
+        stream->lock = try_lock_file(request->id, request->filename, 1);
+        if (stream->lock == NULL) {
+            stream_reply(stream, STATUS_BUSY, 0);
+            return 0;
+        }
+        stream->file_fd = open(stream->path, O_WRONLY);
+        if (stream->file_fd == -1) {
+            stream_reply(stream, errno == ENOENT ? STATUS_BAD_RANGE : STATUS_ERROR, 0);
+            printf("Could not open file: %s\n", stream->path);
+            return 0;
+        }
+        if (resume_file(stream->file_fd, request->offset) != 0) {
+            close(stream->file_fd);
+            stream->file_fd = -1;
+            stream_reply(stream, STATUS_BAD_RANGE, 0);
+            return 0;
+        }
+        stream->reply.length = request->offset + request->size;
+    } else {
+        // A fresh upload is written to a staging file of its own and renamed
+        // over the final one once complete, so readers never see it half
+        // written and it needs no lock until then
+        stream->staging = region_alloc(&stream->region, path_size);
+        if (stream->staging == NULL) {
+            stream_reply(stream, STATUS_ERROR, 0);
+            return 0;
+        }
+        snprintf(stream->staging, path_size, "%s/%s/.%s.%d.%u" STREAM_SUFFIX, folder_path, request->id, request->filename,
+                 conn->socket, stream->id);
+        stream->file_fd = open(stream->staging, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+        if (stream->file_fd == -1) {
+            stream->staging = NULL;
+            stream_reply(stream, STATUS_ERROR, 0);
+            printf("Could not open file: %s\n", stream->path);
+            return 0;
+        }
+        stream->reply.length = request->size;
+    }
+    // No ready reply: the window lets the client start sending at once
+    stream->remaining = request->size;
+    stream->recv_window = PROTOCOL_WINDOW;
+    if (stream->remaining == 0) {
+        finish_upload_stream(stream, folder_path);
+    }
+    return 0;
 }
 
-// Custom free implementation
-void myfree(void *ptr) {
-    if (!ptr) return;
-
-    pthread_mutex_lock(&memory_mutex);
-
-    MemoryBlock *block = (MemoryBlock *)((char *)ptr - sizeof(MemoryBlock));
-    block->is_free = 1;
-
-    // Merge adjacent free blocks
-    MemoryBlock *current = free_list;
-    while (current) {
-        if (current->is_free && current->next && current->next->is_free) {
-            current->size += sizeof(MemoryBlock) + current->next->size;
-            current->next = current->next->next;
+// Act on a received frame header and name. Returns -1 if the connection
+// must close.
+int handle_frame(struct connection *conn, const char *folder_path) {
+    MessageHeader *frame = &conn->header;
+    struct stream *stream;
+
+    conn->frame_stage = FRAME_HEADER;
+    switch (frame->opcode) {
+    case OP_DATA:
+        stream = find_stream(conn, frame->request_id);
+        if (frame->payload_length > PROTOCOL_FRAME_MAX) {
+            return -1;
         }
-        current = current->next;
+        if (stream != NULL && is_upload(stream->opcode) && stream->file_fd != -1) {
+            if (frame->payload_length > (unsigned long long)stream->recv_window || frame->payload_length > (unsigned long long)stream->remaining) {
+                return -1; // Past the window or the announced size
+            }
+            stream->recv_window -= frame->payload_length;
+            conn->frame_stream = stream;
+        } else {
+            conn->frame_stream = NULL; // Upload already failed: drop what was in flight
+        }
+        conn->frame_left = frame->payload_length;
+        conn->frame_stage = FRAME_DATA;
+        return 0;
+    case OP_WINDOW:
+        stream = find_stream(conn, frame->request_id);
+        if (stream != NULL && !is_upload(stream->opcode)) {
+            stream->send_window += frame->payload_length;
+        }
+        return 0; // Late updates for finished streams are harmless
+    default:
+        return open_stream(conn, folder_path);
     }
-    printf("\nAfter myfree: \n");
-    print_arena_space();
-    pthread_mutex_unlock(&memory_mutex);
 }
 
-// Structure to pass arguments to the thread function
-struct client_info {
-    int client_socket;
-    char folder_path[FILE_PATH_BUFFER_SIZE];
-};
-
-// Mutex for synchronizing file operations
-pthread_mutex_t mutex;
+// Store received DATA of an upload stream
+void store_stream_data(struct stream *stream, const char *data, size_t length, const char *folder_path) {
+    for (size_t written = 0; written < length;) {
+        ssize_t n = write(stream->file_fd, data + written, length - written);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            perror("Error writing uploaded file");
+            close(stream->file_fd);
+            stream->file_fd = -1; // The rest of its DATA is dropped
+            stream_reply(stream, STATUS_ERROR, 0);
+            return;
+        }
+        written += n;
+    }
+    stream->remaining -= length;
+    stream->grant += length;
+    if (stream->remaining == 0) {
+        printf("File '%s' uploaded successfully to directory: %s\n", stream->request.filename, stream->path);
+        finish_upload_stream(stream, folder_path);
+    }
+}
 
-// Function to check available disk space in bytes
-unsigned long long get_free_space(const char *path) {
-    struct statvfs stat;
+// Receive frames until the socket runs dry. Returns 1 if anything was
+// received, 0 if nothing was, -1 if the connection must close.
+int receive_frames(struct connection *conn, const char *folder_path) {
+    int progress = 0;
 
-    if (statvfs(path, &stat) != 0) {
-        // Error getting filesystem statistics
-        return 0;
+    while (1) {
+        if (conn->frame_stage == FRAME_HEADER) {
+            int filled = fill_input(conn, PROTOCOL_HEADER_SIZE);
+            if (filled <= 0) return filled < 0 ? -1 : progress;
+            progress = 1;
+            if (protocol_decode((unsigned char *)conn->in, &conn->header) != 0 || conn->header.name_length > PROTOCOL_NAME_MAX) {
+                return -1;
+            }
+            conn->in_len = 0;
+            conn->frame_stage = FRAME_NAME;
+        }
+        if (conn->frame_stage == FRAME_NAME) {
+            int filled = fill_input(conn, conn->header.name_length);
+            if (filled <= 0) return filled < 0 ? -1 : progress;
+            progress = 1;
+            conn->in_len = 0;
+            if (handle_frame(conn, folder_path) != 0) {
+                return -1;
+            }
+        }
+        while (conn->frame_stage == FRAME_DATA && conn->frame_left > 0) {
+            size_t want = conn->frame_left < PROTOCOL_FRAME_MAX ? (size_t)conn->frame_left : PROTOCOL_FRAME_MAX;
+            ssize_t received = recv(conn->socket, conn->in, want, 0);
+            if (received < 0) {
+                if (errno == EINTR) continue;
+                return (errno == EAGAIN || errno == EWOULDBLOCK) ? progress : -1;
+            }
+            if (received == 0) {
+                printf("Client disconnected or error receiving data.\n");
+                return -1;
+            }
+            progress = 1;
+            conn->frame_left -= received;
+            if (conn->frame_stream != NULL && conn->frame_stream->file_fd != -1) {
+                store_stream_data(conn->frame_stream, conn->in, received, folder_path);
+            }
+        }
+        conn->frame_stage = FRAME_HEADER;
     }
-
-    // Calculate the available space in bytes
-    return stat.f_bsize * stat.f_bavail;
 }
 
-// Function to create a directory if it doesn't exist
-void create_directory_if_not_exists(const char *path) {
-    struct stat st = {0};
-
-    if (stat(path, &st) == -1) {
-        if (mkdir(path, 0700) == 0) {
-            printf("Directory created: %s\n", path);
+// Put the stream's next frame in conn->out: its reply, a window update, or
+// DATA as far as its window goes. Returns 1 if there was one, 0 if the
+// stream has nothing to send now, -1 on a read error.
+int next_stream_frame(struct connection *conn, struct stream *stream) {
+    MessageHeader frame = {.request_id = stream->id};
+    size_t length = 0;
+    int done;
+
+    if (stream->reply_pending) {
+        frame = stream->reply;
+        stream->reply_pending = 0;
+        done = is_upload(stream->opcode) || stream->remaining == 0; // Uploads end with their reply
+    } else if (stream->grant >= PROTOCOL_WINDOW / 2) {
+        // Granted in halves so the client is never left waiting on an empty window
+        frame.opcode = OP_WINDOW;
+        frame.payload_length = stream->grant;
+        stream->recv_window += stream->grant;
+        stream->grant = 0;
+        done = 0;
+    } else if (!is_upload(stream->opcode) && stream->remaining > 0 && stream->send_window > 0) {
+        length = PROTOCOL_FRAME_MAX;
+        if ((long long)length > stream->remaining) length = stream->remaining;
+        if ((long long)length > stream->send_window) length = stream->send_window;
+        if (stream->listing != NULL) {
+            memcpy(conn->out + PROTOCOL_HEADER_SIZE, stream->listing + PROTOCOL_HEADER_SIZE + stream->listing_sent, length);
+            stream->listing_sent += length;
         } else {
-            perror("Failed to create directory");
-            exit(EXIT_FAILURE);
+            ssize_t bytes_read = read(stream->file_fd, conn->out + PROTOCOL_HEADER_SIZE, length);
+            if (bytes_read <= 0) {
+                return -1; // The file shrank under us
+            }
+            length = bytes_read;
+        }
+        frame.opcode = OP_DATA;
+        frame.payload_length = length;
+        stream->remaining -= length;
+        stream->send_window -= length;
+        done = stream->remaining == 0;
+        if (done && stream->listing == NULL) {
+            printf("File '%s' sent to client from directory '%s'.\n", stream->request.filename, stream->path);
         }
     } else {
-        printf("Directory already exists: %s\n", path);
+        return 0;
     }
-}
 
-// Function to process the file based on the command
-void process_file(const char *file_path, int client_socket, const char *folder_path) {
-    FILE *file = fopen(file_path, "r");
-    char line[BUFFER_SIZE];
-
-    if (file == NULL) {
-        printf("Could not open file: %s\n", file_path);
-        return;
+    protocol_encode(&frame, (unsigned char *)conn->out);
+    conn->out_len = PROTOCOL_HEADER_SIZE + length;
+    conn->out_sent = 0;
+    if (done) {
+        close_stream(stream);
     }
+    return 1;
+}
 
-    char command[BUFFER_SIZE] = {0};
-    char filename[BUFFER_SIZE] = {0};
-    char path[BUFFER_SIZE] = "/";
-    char filepath[BUFFER_SIZE] = {0};
-    char client_dir[FILE_PATH_BUFFER_SIZE * 3] = {0};
-    char id[MINI_BUFFER_SIZE] = {0};
+// Send frames until the socket is full, taking one from each stream in
+// turn. Returns 1 once nothing is left to send, 0 if the socket is full,
+// -1 on error.
+int send_frames(struct connection *conn) {
+    while (1) {
+        int flushed = flush_output(conn);
+        if (flushed <= 0) return flushed;
+
+        int built = 0;
+        for (int i = 0; i < PROTOCOL_MAX_STREAMS && !built; i++) {
+            int slot = (conn->next_stream + i) % PROTOCOL_MAX_STREAMS;
+            if (!conn->streams[slot].active) continue;
+            built = next_stream_frame(conn, &conn->streams[slot]);
+            if (built < 0) return -1;
+            if (built) conn->next_stream = slot + 1;
+        }
+        if (!built) return 1;
+    }
+}
 
-    // Simple parsing, assuming JSON format {"command": "upload", "filename": "example.txt"}
-    while (fgets(line, sizeof(line), file) != NULL) {
-        if (strstr(line, "\"command\":") != NULL) {
-            sscanf(line, " \"command\": \"%[^\"]\"", command);
-        } else if (strstr(line, "\"ID\":") != NULL) {
-            sscanf(line, " \"ID\": \"%[^\"]\"", id);
-        } else if (strstr(line, "\"filename\":") != NULL) {
-            sscanf(line, " \"filename\": \"%[^\"]\"", filename);
-        } else if (strstr(line, "\"filepath\":") != NULL) {
-            sscanf(line, " \"filepath\": \"%[^\"]\"", filepath);
-            char *last_slash = strrchr(filepath, '/');
+// Drive a multiplexed connection: frames out while the socket takes them,
+// frames in until it runs dry, again while what came in left more to send.
+// Streams waiting for their file's stripe get another try first. Returns 0
+// while it waits for readiness or a stripe, -1 once it should be closed.
+int advance_multiplexed(struct connection *conn, const char *folder_path) {
+    for (int i = 0; i < PROTOCOL_MAX_STREAMS; i++) {
+        if (conn->streams[i].active && conn->streams[i].waiting) {
+            retry_stream(&conn->streams[i], folder_path);
+        }
+    }
+    while (1) {
+        int sent = send_frames(conn);
+        if (sent < 0) return -1;
+        int received = receive_frames(conn, folder_path);
+        if (received < 0) return -1;
+        if (sent == 0 || received == 0) break;
+    }
+    for (int i = 0; i < PROTOCOL_MAX_STREAMS; i++) {
+        if (conn->streams[i].active && conn->streams[i].waiting) {
+            wait_for_lock(conn);
+        }
+    }
+    return 0;
+}
 
-            if (last_slash != NULL) {
-                // Calculate the length of the directory path (excluding the file name)
-                size_t length = last_slash - filepath;
+// Take the file lock the decoded request needs, like process_file does but
+// without waiting: exclusive for an upload, shared for a download or stat.
+// Segments only lock to commit, views not at all. Returns -1 if the stripe
+// is taken.
+int lock_request(struct connection *conn) {
+    struct request *request = conn->request;
 
-                // Copy the directory part into dir_path
-                strncpy(filepath, filepath, length);
+    if (request->opcode != OP_UPLOAD && request->opcode != OP_DOWNLOAD && request->opcode != OP_STAT) {
+        return 0;
+    }
+    conn->lock = try_lock_file(request->id, request->filename, request->opcode == OP_UPLOAD);
+    return conn->lock != NULL ? 0 : -1;
+}
 
-                // Null-terminate the string
-                filepath[length] = '\0';
-                last_slash++;
-                strncpy(filename, last_slash, strlen(last_slash));
-            }
-        }
+// Decode the received request; STATE_LOCK then takes its file lock and
+// open_request sets the transfer up
+void start_request(struct connection *conn) {
+    conn->state = STATE_CLOSE;
+    conn->request = region_zalloc(&conn->region, sizeof(struct request));
+    conn->client_dir = region_zalloc(&conn->region, FILE_PATH_BUFFER_SIZE * 3);
+    if (!conn->request || !conn->client_dir) {
+        printf("Could not allocate request buffers.\n");
+        send_reply(conn, STATUS_ERROR, 0, STATE_CLOSE);
+        return;
+    }
+    if (decode_request(&conn->header, conn->in, conn->request) != STATUS_OK) {
+        // Nothing beyond the name was sent, so the connection stays usable
+        send_reply(conn, STATUS_BAD_REQUEST, 0, STATE_FINISHED);
+        return;
     }
 
-    fclose(file);
-    snprintf(client_dir, sizeof(client_dir), "/home/sana-hashim/Desktop/bscs22101_bscs22017_Group_D_OS-main/%s", id);
+    // Nothing is queued in this mode, only the in-flight cap applies
+    int retry_after = admit_request(0);
+    if (retry_after) {
+        reject_busy(conn->socket, retry_after);
+        return; // Closed in STATE_CLOSE
+    }
+    conn->admitted = 1;
+    conn->state = STATE_LOCK;
+}
 
-    if (strcmp(command, "upload") == 0) {
-        create_directory_if_not_exists(client_dir);
+// Set the connection up for its decoded and locked request. Mirrors
+// process_file, but leaves the transfer itself to the state machine.
+void open_request(struct connection *conn, const char *folder_path) {
+    size_t client_dir_size = FILE_PATH_BUFFER_SIZE * 3;
+    struct request *request = conn->request;
+    char *client_dir = conn->client_dir;
+    snprintf(client_dir, client_dir_size, "%s/%s", folder_path, request->id);
+
+    if (is_upload(request->opcode)) {
+        if (create_directory_if_not_exists(client_dir) != 0) {
+            send_reply(conn, STATUS_ERROR, 0, STATE_FINISHED); // Refused before the content was sent
+            return;
+        }
         unsigned long long free_space = get_free_space(client_dir);
         printf("Free space on path %s: %llu bytes\n", client_dir, free_space);
 
-        if (free_space > 10000) { // Check if there is more than 10KB free space
-            char success_message[] = "Success: Ready to receive file.";
-            send(client_socket, success_message, strlen(success_message), 0);
-
-            if (snprintf(client_dir + strlen(client_dir), sizeof(client_dir) - strlen(client_dir), "/%s", filename) >= (sizeof(client_dir) - strlen(client_dir))) {
-                printf("Error: client_dir path too long.\n");
+        if (free_space < (unsigned long long)request->size + 10000) { // Room for the file and 10KB spare
+            send_reply(conn, STATUS_NO_SPACE, 0, STATE_FINISHED); // Refused before the content was sent
+            printf("Not enough disk space for file: %s\n", request->filename);
+            return;
+        }
+        snprintf(client_dir + strlen(client_dir), client_dir_size - strlen(client_dir), "/%s", request->filename);
+        if (request->opcode == OP_SEGMENT) {
+            int status;
+            conn->file_fd = open_segment(request, folder_path, &status);
+            if (conn->file_fd == -1) {
+                send_reply(conn, status, 0, STATE_FINISHED);
+                printf("Could not open a segment of '%s'.\n", request->filename);
                 return;
             }
+            conn->remaining = request->size;
+            send_reply(conn, STATUS_OK, 0, STATE_UPLOAD); // Ready to receive
+            return;
+        }
+        conn->file_fd = open(client_dir, request->offset > 0 ? O_WRONLY : O_WRONLY | O_CREAT | O_TRUNC, 0666);
+        if (conn->file_fd == -1) {
+            send_reply(conn, request->offset > 0 && errno == ENOENT ? STATUS_BAD_RANGE : STATUS_ERROR, 0, STATE_FINISHED);
+            printf("Could not open file: %s\n", client_dir);
+            return;
+        }
+        if (request->offset > 0 && resume_file(conn->file_fd, request->offset) != 0) {
+            send_reply(conn, STATUS_BAD_RANGE, 0, STATE_FINISHED);
+            printf("Cannot resume '%s' at byte %lld.\n", request->filename, request->offset);
+            return;
+        }
+        conn->remaining = request->size;
+        send_reply(conn, STATUS_OK, 0, STATE_UPLOAD); // Ready to receive
+    } else if (request->opcode == OP_DOWNLOAD) {
+        struct stat file_stat;
 
-            // Open the new file where content will be written
-            FILE *new_file = fopen(client_dir, "wb");
-            if (new_file == NULL) {
-                printf("Could not create file: %s\n", client_dir);
-                return;
-            }
+        snprintf(client_dir, client_dir_size, "%s/%s/%s", folder_path, request->id, request->filename);
+        conn->file_fd = open(client_dir, O_RDONLY);
+        if (conn->file_fd == -1 || fstat(conn->file_fd, &file_stat) != 0) {
+            send_reply(conn, STATUS_NOT_FOUND, 0, STATE_FINISHED);
+            printf("File '%s' not found in directory '%s'.\n", request->filename, client_dir);
+            return;
+        }
+        conn->file_size = file_stat.st_size;
+        if (request->offset > file_stat.st_size || lseek(conn->file_fd, request->offset, SEEK_SET) != request->offset) {
+            send_reply(conn, STATUS_BAD_RANGE, 0, STATE_FINISHED);
+            return;
+        }
+        conn->remaining = file_stat.st_size - request->offset;
+        if (request->length > 0 && request->length < conn->remaining) {
+            conn->remaining = request->length;
+        }
+        send_reply(conn, STATUS_OK, conn->remaining, STATE_DOWNLOAD);
+    } else if (request->opcode == OP_STAT) {
+        struct stat file_stat;
 
-            // Receive file content in chunks from the client
-            char file_content[BUFFER_SIZE] = {0};
-            int bytes_received;
+        snprintf(client_dir, client_dir_size, "%s/%s/%s", folder_path, request->id, request->filename);
+        int found = stat(client_dir, &file_stat) == 0;
+        release_request_lock(conn);
+        if (!found) {
+            send_reply(conn, STATUS_NOT_FOUND, 0, STATE_FINISHED);
+            return;
+        }
+        conn->file_size = file_stat.st_size;
+        send_reply(conn, STATUS_OK, 0, STATE_FINISHED);
+    } else if (request->opcode == OP_MULTIPLEX) {
+        if (switch_to_multiplexed(conn) != 0) {
+            printf("Could not allocate stream buffers.\n");
+            send_reply(conn, STATUS_ERROR, 0, STATE_FINISHED);
+            return;
+        }
+        release_admission(conn); // The streams are not counted
+        send_reply(conn, STATUS_OK, 0, STATE_MULTIPLEXED);
+    } else {
+        size_t length;
+        char *listing = format_listing(client_dir, &conn->region, &length);
+        if (listing == NULL) {
+            send_reply(conn, STATUS_NOT_FOUND, 0, STATE_FINISHED);
+            return;
+        }
 
-            // Lock mutex before receiving file content
-            pthread_mutex_lock(&mutex);
+        // The listing goes out as the reply's payload, right behind its header
+        MessageHeader header = {.opcode = OP_VIEW, .status = STATUS_OK, .payload_length = length, .request_id = request->request_id};
+        protocol_encode(&header, (unsigned char *)listing);
+        conn->out = listing;
+        conn->out_len = PROTOCOL_HEADER_SIZE + length;
+        conn->out_sent = 0;
+        conn->state = STATE_SEND_REPLY;
+        conn->next_state = STATE_FINISHED;
+    }
+}
 
-            // Loop to receive file content in chunks
-            while ((bytes_received = recv(client_socket, file_content, sizeof(file_content), 0)) > 0) {
-                fwrite(file_content, 1, bytes_received, new_file);
+// Drive a connection as far as it goes without blocking. Returns 0 while it
+// waits for the next readiness event, -1 once it should be closed.
+int advance_connection(struct connection *conn, const char *folder_path) {
+    while (1) {
+        switch (conn->state) {
+        case STATE_READ_HEADER: {
+            int filled = fill_input(conn, PROTOCOL_HEADER_SIZE);
+            if (filled <= 0) return filled;
+            if (protocol_decode((unsigned char *)conn->in, &conn->header) != 0 || conn->header.name_length > PROTOCOL_NAME_MAX) {
+                send_reply(conn, STATUS_BAD_REQUEST, 0, STATE_CLOSE);
+                break;
             }
-
-            // Unlock mutex after file operations
-            pthread_mutex_unlock(&mutex);
-
-            // Close the file after all data is received
-            fclose(new_file);
-            printf("File '%s' uploaded successfully to directory: %s\n", filename, client_dir);
-
-        } else {
-            char failure_message[] = "Failure: Not enough disk space.";
-            send(client_socket, failure_message, strlen(failure_message), 0);
-            printf("Not enough disk space for file: %s\n", filename);
+            conn->in_len = 0;
+            conn->state = STATE_READ_NAME;
+            break;
+        }
+        case STATE_READ_NAME: {
+            int filled = fill_input(conn, conn->header.name_length);
+            if (filled <= 0) return filled;
+            start_request(conn);
+            break;
+        }
+        case STATE_LOCK:
+            if (lock_request(conn) != 0) {
+                wait_for_lock(conn);
+                return 0;
+            }
+            open_request(conn, folder_path);
+            break;
+        case STATE_SEND_REPLY: {
+            int flushed = flush_output(conn);
+            if (flushed <= 0) return flushed;
+            conn->state = conn->next_state;
+            break;
+        }
+        case STATE_UPLOAD: {
+            if (conn->remaining == 0) {
+                release_request_lock(conn); // Every byte is written
+                if (conn->request->opcode == OP_SEGMENT) {
+                    int recorded = record_segment(conn->request);
+                    conn->file_size = conn->request->length;
+                    if (recorded == 1) {
+                        conn->state = STATE_COMMIT;
+                        break;
+                    }
+                    send_reply(conn, recorded < 0 ? STATUS_ERROR : STATUS_OK, 0, STATE_FINISHED);
+                    break;
+                }
+                printf("File '%s' uploaded successfully to directory: %s\n", conn->request->filename, conn->client_dir);
+                conn->file_size = conn->request->offset + conn->request->size;
+                send_reply(conn, STATUS_OK, 0, STATE_FINISHED);
+                break;
+            }
+            size_t want = conn->remaining < BUFFER_SIZE ? (size_t)conn->remaining : BUFFER_SIZE;
+            ssize_t received = recv(conn->socket, conn->in, want, 0);
+            if (received < 0) {
+                if (errno == EINTR) continue;
+                return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+            }
+            if (received == 0) {
+                printf("Upload of '%s' stopped by the client.\n", conn->request->filename);
+                return -1;
+            }
+            for (ssize_t written = 0; written < received;) {
+                ssize_t n = write(conn->file_fd, conn->in + written, received - written);
+                if (n < 0) {
+                    if (errno == EINTR) continue;
+                    perror("Error writing uploaded file");
+                    send_reply(conn, STATUS_ERROR, 0, STATE_CLOSE);
+                    break;
+                }
+                written += n;
+            }
+            conn->remaining -= received;
+            break;
+        }
+        case STATE_COMMIT: {
+            pthread_rwlock_t *lock = try_lock_file(conn->request->id, conn->request->filename, 1);
+            if (lock == NULL) {
+                wait_for_lock(conn);
+                return 0;
+            }
+            int committed = commit_segment(conn->request, folder_path);
+            unlock_file(lock);
+            if (committed > 0) {
+                printf("File '%s' put together from segments in directory: %s\n", conn->request->filename, conn->client_dir);
+            }
+            send_reply(conn, committed < 0 ? STATUS_ERROR : STATUS_OK, 0, STATE_FINISHED);
+            break;
+        }
+        case STATE_DOWNLOAD: {
+            int flushed = flush_output(conn);
+            if (flushed <= 0) return flushed;
+            if (conn->remaining == 0) {
+                release_request_lock(conn);
+                printf("File '%s' sent to client from directory '%s'.\n", conn->request->filename, conn->client_dir);
+                conn->state = STATE_FINISHED;
+                break;
+            }
+            size_t want = conn->remaining < BUFFER_SIZE * 2 ? (size_t)conn->remaining : BUFFER_SIZE * 2;
+            ssize_t bytes_read = read(conn->file_fd, conn->out, want);
+            if (bytes_read <= 0) {
+                return -1; // The file shrank under us
+            }
+            conn->out_len = bytes_read;
+            conn->remaining -= bytes_read;
+            break;
         }
+        case STATE_MULTIPLEXED:
+            return advance_multiplexed(conn, folder_path);
+        case STATE_FINISHED:
+            // Pipelined requests may already be waiting; the loop reads them
+            if (reset_connection(conn) != 0) return -1;
+            break;
+        case STATE_CLOSE:
+            return -1;
+        }
+    }
+}
 
+// Set up a connection object for an accepted socket and add it to the epoll
+// set, closing the socket if that fails. Handed-off sockets arrive already
+// multiplexed.
+void watch_connection(int epoll_fd, int client_socket, int multiplexed) {
+    struct connection *conn = slab_alloc(&connection_slab);
+    if (conn == NULL || set_nonblocking(client_socket) == -1) {
+        fprintf(stderr, "Failed to set up connection.\n");
+        slab_free(&connection_slab, conn);
+        close(client_socket);
         return;
-    } else if (strcmp(command, "download") == 0) {
-        char file_content[BUFFER_SIZE];
-        FILE *file_to_send;
-        int bytes_read;
+    }
+    conn->socket = client_socket;
+    conn->state = STATE_READ_HEADER;
+    region_init(&conn->region, BUFFER_SIZE * 4); // Idle connections only hold the request buffers
+    conn->in = region_alloc(&conn->region, BUFFER_SIZE);
+    conn->out = region_alloc(&conn->region, BUFFER_SIZE * 2);
+    if (multiplexed && switch_to_multiplexed(conn) == 0) {
+        conn->state = STATE_MULTIPLEXED;
+    } else if (multiplexed) {
+        conn->in = NULL; // Fails below
+    }
 
-        // Construct the full path to the file
-        printf("client dir: %s\n", client_dir);
-        char full_file_path[FILE_PATH_BUFFER_SIZE] = "/home/sana-hashim/Desktop/bscs22101_bscs22017_Group_D_OS-main";
-        snprintf(client_dir, sizeof(client_dir), "%s/%s/%s", full_file_path, id, filename);
+    struct epoll_event event;
+    event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    event.data.ptr = conn;
+    if (conn->in == NULL || conn->out == NULL || epoll_ctl(epoll_fd, EPOLL_CTL_ADD, client_socket, &event) == -1) {
+        perror("Failed to watch connection");
+        close_connection(conn);
+    }
+}
 
-        // Open the file
-        file_to_send = fopen(client_dir, "rb"); // Use "rb" for reading binary files
-        if (file_to_send == NULL) {
-            char failure_message[] = "Failure: File not found.";
-            send(client_socket, failure_message, strlen(failure_message), 0);
-            printf("File '%s' not found in directory '%s'.\n", filename, client_dir);
+// Accept every pending connection on the (non-blocking) listening socket
+void accept_connections(int epoll_fd, int server_socket) {
+    while (1) {
+        int client_socket = accept(server_socket, NULL, NULL);
+        if (client_socket == -1) {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                perror("Accepting connection failed");
+            }
             return;
         }
 
-        char success_message[BUFFER_SIZE] = "File content: ";
-        send(client_socket, success_message, strlen(success_message), 0);
+        set_nodelay(client_socket);
+        watch_connection(epoll_fd, client_socket, 0);
+    }
+}
 
-        // Lock mutex before sending file content
-        pthread_mutex_lock(&mutex);
+// Take over every socket handed off since the last signal
+void adopt_connections(int epoll_fd) {
+    uint64_t signals;
+    void *item;
 
-        // Send the file content to the client
-        while ((bytes_read = fread(file_content, 1, sizeof(file_content), file_to_send)) > 0) {
-            send(client_socket, file_content, bytes_read, 0);
-        }
+    if (read(handoff_event, &signals, sizeof(signals)) == -1 && errno != EAGAIN) {
+        perror("Reading the handoff signal failed");
+    }
+    while ((item = try_dequeue(&handoff_queue)) != NULL) {
+        watch_connection(epoll_fd, (int)(intptr_t)item - 1, 1);
+    }
+}
 
-        // Unlock mutex after file operations
-        pthread_mutex_unlock(&mutex);
+// Serve connections accepted on server_socket, or with server_socket -1,
+// only those handed off through handoff_event
+int run_event_loop(int server_socket, const char *folder_path) {
+    struct epoll_event events[MAX_EVENTS];
+    int epoll_fd = epoll_create1(0);
 
-        fclose(file_to_send);
-        printf("File '%s' sent to client from directory '%s'.\n", filename, client_dir);
-        return;
-    } else if (strcmp(command, "view") == 0) {
-        DIR *dir;
-        struct dirent *entry;
-        struct stat file_stat;
-        char file_path[FILE_PATH_BUFFER_SIZE * 4];
-        char message[BUFFER_SIZE * 2]; // Larger buffer for sending details
-
-        // Open the directory
-        if ((dir = opendir(client_dir)) != NULL) {
-            // Lock mutex before accessing the directory
-            pthread_mutex_lock(&mutex);
-
-            // Loop through the files in the directory
-            while ((entry = readdir(dir)) != NULL) {
-                // Skip "." and ".."
-                if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
-                    continue;
-                }
+    if (epoll_fd == -1 || (server_socket != -1 && set_nonblocking(server_socket) == -1)) {
+        perror("Event loop setup failed");
+        return -1;
+    }
+    if (slab_init(&connection_slab, sizeof(struct connection), SLAB_OBJECTS, construct_connection) != 0) {
+        fprintf(stderr, "Failed to allocate connection pool.\n");
+        return -1;
+    }
 
-                // Construct the full path to the file
-                snprintf(file_path, sizeof(file_path), "%s/%s", client_dir, entry->d_name);
+    // The listening socket and the handoff signal are the only entries
+    // without a connection
+    struct epoll_event event;
+    event.events = EPOLLIN | EPOLLET;
+    event.data.ptr = NULL;
+    if (server_socket != -1 && epoll_ctl(epoll_fd, EPOLL_CTL_ADD, server_socket, &event) == -1) {
+        perror("Event loop setup failed");
+        return -1;
+    }
+    event.data.ptr = &handoff_marker;
+    if (handoff_event != -1 && epoll_ctl(epoll_fd, EPOLL_CTL_ADD, handoff_event, &event) == -1) {
+        perror("Event loop setup failed");
+        return -1;
+    }
 
-                // Get file stats (size, modification time)
-                if (stat(file_path, &file_stat) == 0) {
-                    // Format the file details
-                    snprintf(message, sizeof(message), "File: %s | Size: %ld bytes | Last modified: %s\n", entry->d_name, (long)file_stat.st_size, ctime(&file_stat.st_mtime));
-                    send(client_socket, message, strlen(message), 0);
-                }
-            }
+    while (1) {
+        int ready = epoll_wait(epoll_fd, events, MAX_EVENTS, waiting_connections != NULL ? LOCK_RETRY_MS : -1);
+        if (ready == -1) {
+            if (errno == EINTR) continue;
+            perror("epoll_wait failed");
+            return -1;
+        }
 
-            // Unlock mutex after accessing the directory
-            pthread_mutex_unlock(&mutex);
+        for (int i = 0; i < ready; i++) {
+            struct connection *conn = events[i].data.ptr;
+            if (conn == NULL) {
+                accept_connections(epoll_fd, server_socket);
+            } else if (events[i].data.ptr == &handoff_marker) {
+                adopt_connections(epoll_fd);
+            } else if (advance_connection(conn, folder_path) != 0) {
+                close_connection(conn);
+            }
+        }
 
-            closedir(dir); // Close the directory
-        } else {
-            perror("Error opening directory for reading");
+        // Those still waiting for a stripe go back on the list
+        struct connection *retry = waiting_connections;
+        waiting_connections = NULL;
+        while (retry != NULL) {
+            struct connection *conn = retry;
+            retry = conn->next_waiting;
+            conn->waiting = 0;
+            if (advance_connection(conn, folder_path) != 0) {
+                close_connection(conn);
+            }
         }
-        return;
     }
 }
 
-// Thread function to handle client requests
-void *handle_client(void *arg) {
-    struct client_info *info = (struct client_info *)arg;
-    int client_socket = info->client_socket;
-    char *folder_path = info->folder_path;
-
-    // Buffer for receiving commands from the client
-    char buffer[BUFFER_SIZE];
-
-    // Receive the command from the client
-    int bytes_received = recv(client_socket, buffer, sizeof(buffer), 0);
-    if (bytes_received <= 0) {
-        printf("Client disconnected or error receiving data.\n");
-        close(client_socket);
-        myfree(info);
-        return NULL;
-    }
-
-    buffer[bytes_received] = '\0'; // Null-terminate the received data
-
-    // Process the file based on the received command
-    process_file(buffer, client_socket, folder_path);
-
-    // Close the client socket
-    close(client_socket);
-    myfree(info);
+void *run_multiplexing_loop(void *arg) {
+    (void)arg;
+    run_event_loop(-1, SERVER_ROOT);
     return NULL;
 }
 
 // Main function
-int main() {
+int main(int argc, char *argv[]) {
     int server_socket, client_socket;
     struct sockaddr_in server_addr, client_addr;
     socklen_t client_addr_len = sizeof(client_addr);
+    int workers = DEFAULT_WORKERS;
+    int listen_backlog = DEFAULT_LISTEN_BACKLOG;
+    int event_loop = 0;
+    int pin = 0;
+    int id_cap = 0;
+    int small_lane_workers = DEFAULT_SMALL_LANE_WORKERS;
+    int opt;
+
+    // -W entries are applied as they are parsed; the default caps are set below
+    fair_init(&fair_queue, DEFAULT_ID_WEIGHT, 1);
+    fair_init(&small_queue, DEFAULT_ID_WEIGHT, 1);
+
+    while ((opt = getopt(argc, argv, "w:m:b:pfc:l:H:L:W:C:s:n:t:")) != -1) {
+        switch (opt) {
+        case 'w':
+            workers = atoi(optarg);
+            break;
+        case 'm':
+            if (strcmp(optarg, "epoll") == 0) {
+                event_loop = 1;
+            } else if (strcmp(optarg, "threads") != 0) {
+                fprintf(stderr, "Unknown mode: %s\n", optarg);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'b':
+            if (strcmp(optarg, "copy") == 0) {
+                use_zero_copy = 0;
+                use_uring = 0;
+            } else if (strcmp(optarg, "uring") == 0) {
+                use_zero_copy = 0;
+            } else if (strcmp(optarg, "pipeline") == 0) {
+                use_pipeline = 1; // Downloads stay zero-copy
+            } else if (strcmp(optarg, "zerocopy") != 0) {
+                fprintf(stderr, "Unknown transfer backend: %s\n", optarg);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'p':
+            pin = 1;
+            break;
+        case 'f':
+            preallocate = 1;
+            break;
+        case 'c':
+            admission.max_in_flight = atoi(optarg);
+            break;
+        case 'l':
+            listen_backlog = atoi(optarg);
+            break;
+        case 'H':
+            admission.high_watermark = strtoul(optarg, NULL, 10);
+            break;
+        case 'L':
+            admission.low_watermark = strtoul(optarg, NULL, 10);
+            break;
+        case 'W': {
+            // id=weight[:cap]
+            char id[FAIR_KEY_SIZE];
+            int weight, cap = 0;
+            if (sscanf(optarg, "%63[^=]=%d:%d", id, &weight, &cap) < 2 || fair_configure(&fair_queue, id, weight, cap) != 0 ||
+                fair_configure(&small_queue, id, weight, cap) != 0) {
+                fprintf(stderr, "Bad weight: %s (expected id=weight[:cap])\n", optarg);
+                return EXIT_FAILURE;
+            }
+            break;
+        }
+        case 'C':
+            id_cap = atoi(optarg);
+            break;
+        case 's':
+            small_job_bytes = atoll(optarg);
+            break;
+        case 'n':
+            small_lane_workers = atoi(optarg);
+            break;
+        case 't':
+            idle_timeout_ms = atoll(optarg) * 1000;
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-m threads|epoll] [-w workers] [-p] [-b zerocopy|pipeline|uring|copy] [-f]\n"
+                            "          [-c max in flight] [-l listen backlog] [-H high watermark] [-L low watermark]\n"
+                            "          [-W id=weight[:cap]]... [-C in-flight cap per id]\n"
+                            "          [-s small job bytes] [-n small-job lane workers] [-t idle timeout seconds]\n", argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    if (workers < 1 || small_lane_workers < 1) {
+        fprintf(stderr, "Worker counts must be at least 1.\n");
+        return EXIT_FAILURE;
+    }
+    if (admission.max_in_flight < 1 || listen_backlog < 1 || idle_timeout_ms < 1 || admission.low_watermark > admission.high_watermark) {
+        fprintf(stderr, "Limits must be positive and the low watermark at most the high watermark.\n");
+        return EXIT_FAILURE;
+    }
+    admission.workers = workers;
+
+    // By default one ID may hold half the workers, leaving the rest to others
+    fair_queue.default_cap = id_cap > 0 ? id_cap : (workers + 1) / 2;
+    small_queue.default_cap = id_cap > 0 ? id_cap : small_lane_workers + workers;
+
+    // A client that hangs up mid-transfer must not kill the server
+    signal(SIGPIPE, SIG_IGN);
+
     initialize_arena();
+    if (slab_init(&client_info_slab, sizeof(struct client_info), SLAB_OBJECTS, construct_client_info) != 0) {
+        fprintf(stderr, "Failed to allocate client info pool.\n");
+        return EXIT_FAILURE;
+    }
+
+    init_file_locks();
+
+    // Start the worker pool, pinned to CPUs with -p. Workers keep their
+    // buffers in a region, so a small stack is enough. The event loop serves
+    // everything from this thread.
+    if (!event_loop && (scheduler_start(&scheduler, workers, CLIENT_THREAD_STACK_SIZE, pin, handle_client, init_worker) != 0 ||
+                        scheduler_start(&small_lane, small_lane_workers, CLIENT_THREAD_STACK_SIZE, pin, handle_small_job, init_worker) != 0)) {
+        fprintf(stderr, "Failed to start the worker pool.\n");
+        return EXIT_FAILURE;
+    }
+    if (use_pipeline && scheduler_start(&disk_writers, DEFAULT_DISK_WRITERS, CLIENT_THREAD_STACK_SIZE, pin, write_upload_chunk, NULL) != 0) {
+        fprintf(stderr, "Failed to start the disk writers.\n");
+        return EXIT_FAILURE;
+    }
+
+    // Keep-alive connections wait for their next request off the workers
+    pthread_t idle_poller;
+    if (!event_loop && ((idle_epoll = epoll_create1(0)) == -1 || pthread_create(&idle_poller, NULL, poll_idle_connections, NULL) != 0)) {
+        fprintf(stderr, "Failed to start the idle connection poller.\n");
+        return EXIT_FAILURE;
+    }
 
-    // Initialize mutex
-    pthread_mutex_init(&mutex, NULL);
+    // Multiplexed connections move to an event loop thread
+    pthread_t multiplexing_loop;
+    if (!event_loop && (init_queue(&handoff_queue, SLAB_OBJECTS, 0) != 0 || (handoff_event = eventfd(0, EFD_NONBLOCK)) == -1 ||
+                        pthread_create(&multiplexing_loop, NULL, run_multiplexing_loop, NULL) != 0)) {
+        fprintf(stderr, "Failed to start the multiplexing loop.\n");
+        return EXIT_FAILURE;
+    }
 
     // Create server socket
     if ((server_socket = socket(AF_INET, SOCK_STREAM, 0)) == -1) {
@@ -406,13 +2997,20 @@ int main() {
     }
 
     // Start listening for incoming connections
-    if (listen(server_socket, 5) == -1) {
+    if (listen(server_socket, listen_backlog) == -1) {
         perror("Listening failed");
         close(server_socket);
         return EXIT_FAILURE;
     }
 
-    printf("Server is listening on port %d...\n", PORT);
+    if (event_loop) {
+        printf("Server is listening on port %d with an epoll event loop...\n", PORT);
+        run_event_loop(server_socket, SERVER_ROOT);
+        close(server_socket);
+        return EXIT_FAILURE;
+    }
+
+    printf("Server is listening on port %d with %d workers...\n", PORT, workers);
 
     while (1) {
         // Accept a new client connection
@@ -421,22 +3019,24 @@ int main() {
             continue;
         }
 
-        // Allocate memory for client info
-        struct client_info *info = mymalloc(sizeof(struct client_info));
-        info->client_socket = client_socket;
-        strncpy(info->folder_path, "/home/sana-hashim/Desktop/bscs22101_bscs22017_Group_D_OS-main", FILE_PATH_BUFFER_SIZE);
-
-        // Create a new thread to handle the client
-        pthread_t tid;
-        if (pthread_create(&tid, NULL, handle_client, info) != 0) {
-            perror("Thread creation failed");
-            myfree(info);
+        // Take a preconstructed client info from the pool. Admission
+        // happens per request, at intake.
+        struct client_info *info = slab_alloc(&client_info_slab);
+        if (info == NULL) {
+            fprintf(stderr, "Failed to allocate client info.\n");
             close(client_socket);
+            continue;
         }
+        info->client_socket = client_socket;
+        region_init(&info->region, REGION_BLOCK_SIZE);
+        set_nodelay(client_socket);
+
+        // Hand the connection to the worker pool once its request arrives,
+        // waiting for room when every worker's queue is full
+        await_request(info);
     }
 
     // Cleanup
     close(server_socket);
-    pthread_mutex_destroy(&mutex);
     return EXIT_SUCCESS;
 }
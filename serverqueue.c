@@ -14,243 +14,14 @@
 #include <ctype.h>
 #include <stdint.h>
 #include<semaphore.h>
+
+#include "arena.h"
+
 #define PORT 8001
 #define MINI_BUFFER_SIZE 512
 #define BUFFER_SIZE 1024
 #define FILE_PATH_BUFFER_SIZE 2048
 
-
-
-
-
-#define ARENA_SIZE (10 * 1024 * 1024) // 10MB
-#define ALIGNMENT 8 // Memory alignment
-
-// Structure for managing memory blocks
-typedef struct MemoryBlock {
-    size_t size;              // Size of the block
-    int is_free;              // Is the block free?
-    struct MemoryBlock *next; // Pointer to the next block
-} MemoryBlock;
-
-static void *arena = NULL;       // Memory arena
-static MemoryBlock *free_list = NULL; // List of free blocks
-pthread_mutex_t memory_mutex;    // Mutex for thread-safe memory operations
-
-// Helper function to align sizes
-size_t align_size(size_t size) {
-    return (size + (ALIGNMENT - 1)) & ~(ALIGNMENT - 1);
-}
-
-// Initialize the arena
-void initialize_arena() {
-    if (!arena) {
-        arena = malloc(ARENA_SIZE);
-        if (!arena) {
-            fprintf(stderr, "Failed to allocate memory arena.\n");
-            exit(EXIT_FAILURE);
-        }
-
-        // Initialize the free list with a single large block
-        free_list = (MemoryBlock *)arena;
-        free_list->size = ARENA_SIZE - sizeof(MemoryBlock);
-        free_list->is_free = 1;
-        free_list->next = NULL;
-
-        pthread_mutex_init(&memory_mutex, NULL);
-        printf("Memory arena initialized with size: %d bytes\n", ARENA_SIZE);
-    }
-}
-void calculate_arena_space(size_t *used_space, size_t *free_space) {
-    *used_space = 0;
-    *free_space = 0;
-
-    MemoryBlock *current = (MemoryBlock *)arena;
-    while ((void *)current < (void *)((char *)arena + ARENA_SIZE)) {
-        if (current->is_free) {
-            *free_space += current->size;
-        } else {
-            *used_space += current->size;
-        }
-        if (!current->next) break;
-        current = current->next;
-    }
-}
-
-void print_arena_space2() {
-    size_t used_space, free_space;
-    calculate_arena_space(&used_space, &free_space);
-    printf("Arena Space: Used = %zu bytes, Free = %zu bytes\n", used_space, free_space);
-}
-void print_arena_space() {
-    size_t used_space, free_space;
-    calculate_arena_space(&used_space, &free_space);
-    printf("Arena Space: Used = %zu bytes\n", used_space);
-}
-// Custom malloc implementation
-void *mymalloc(size_t size) {
-    pthread_mutex_lock(&memory_mutex);
-
-    size = align_size(size); // Align the requested size
-    MemoryBlock *current = free_list;
-    MemoryBlock *prev = NULL;
-
-    // Find a free block that fits the requested size
-    while (current && (!current->is_free || current->size < size)) {
-        prev = current;
-        current = current->next;
-    }
-
-    if (!current) {
-        pthread_mutex_unlock(&memory_mutex);
-        return NULL; // No suitable block found
-    }
-
-    // Split the block if there's enough space for another block
-    if (current->size > size + sizeof(MemoryBlock)) {
-        MemoryBlock *new_block = (MemoryBlock *)((char *)current + sizeof(MemoryBlock) + size);
-        new_block->size = current->size - size - sizeof(MemoryBlock);
-        new_block->is_free = 1;
-        new_block->next = current->next;
-
-        current->size = size;
-        current->next = new_block;
-    }
-
-    current->is_free = 0;
-    printf("\nAfter mymalloc: \n");
-    print_arena_space2();
-    pthread_mutex_unlock(&memory_mutex);
-
-    return (char *)current + sizeof(MemoryBlock);
-}
-
-// Custom free implementation
-void myfree(void *ptr) {
-    if (!ptr) return;
-
-    pthread_mutex_lock(&memory_mutex);
-
-    MemoryBlock *block = (MemoryBlock *)((char *)ptr - sizeof(MemoryBlock));
-    block->is_free = 1;
-
-    // Merge adjacent free blocks
-    MemoryBlock *current = free_list;
-    while (current) {
-        if (current->is_free && current->next && current->next->is_free) {
-            current->size += sizeof(MemoryBlock) + current->next->size;
-            current->next = current->next->next;
-        }
-        current = current->next;
-    }
-    printf("\nAfter myfree: \n");
-    print_arena_space();
-    pthread_mutex_unlock(&memory_mutex);
-}
-
-
-
-
-
-
-
-
-
-
-
-#define QUEUE_CAPACITY 10
-
-// Queue structure for file operations
-typedef struct {
-    char *data[QUEUE_CAPACITY]; // Array of pointers to data
-    int front;                  // Index of the front of the queue
-    int rear;                   // Index of the rear of the queue
-    int count;                  // Number of items in the queue
-} Queue;
-
-// Queue and synchronization variables
-Queue queue;
-pthread_mutex_t queue_mutex;
-sem_t queue_sem;
-
-// Function prototypes
-void init_queue();
-void enqueue(char *item);
-char *dequeue();
-int is_queue_empty();
-int is_queue_full();
-
-
-void init_queue() {
-    queue.front = 0;
-    queue.rear = -1;
-    queue.count = 0;
-    pthread_mutex_init(&queue_mutex, NULL);
-    sem_init(&queue_sem, 0, 0); // Initialize semaphore with 0
-}
-
-void enqueue(char *item) {
-    pthread_mutex_lock(&queue_mutex);
-    if (is_queue_full()) {
-        printf("Queue is full, cannot enqueue.\n");
-    } else {
-        queue.rear = (queue.rear + 1) % QUEUE_CAPACITY;
-        queue.data[queue.rear] = strdup(item); // Duplicate the string
-        queue.count++;
-        sem_post(&queue_sem); // Signal that data is available
-    }
-    pthread_mutex_unlock(&queue_mutex);
-}
-
-char *dequeue() {
-    pthread_mutex_lock(&queue_mutex);
-    char *item = NULL;
-    if (is_queue_empty()) {
-        printf("Queue is empty, cannot dequeue.\n");
-    } else {
-        item = queue.data[queue.front];
-        queue.front = (queue.front + 1) % QUEUE_CAPACITY;
-        queue.count--;
-    }
-    pthread_mutex_unlock(&queue_mutex);
-    return item;
-}
-
-int is_queue_empty() {
-    return queue.count == 0;
-}
-
-int is_queue_full() {
-    return queue.count == QUEUE_CAPACITY;
-}
-void *file_handler(void *arg) {
-    while (1) {
-        // Wait until the queue is not empty
-        sem_wait(&queue_sem);
-
-        // Dequeue an item and process it
-        char *data = dequeue();
-        if (data) {
-            printf("Processing data: %s\n", data);
-            // Perform file read/write operations here
-
-            free(data); // Free the allocated memory for dequeued item
-        }
-    }
-    return NULL;
-}
-
-
-
-
-
-
-
-
-
-
-
-
 // Structure to pass arguments to the thread function
 struct client_info {
     int client_socket;
@@ -536,6 +307,11 @@ int main() {
 
         // Allocate memory for client info
         struct client_info *info = mymalloc(sizeof(struct client_info));
+        if (info == NULL) {
+            fprintf(stderr, "Failed to allocate client info.\n");
+            close(client_socket);
+            continue;
+        }
         info->client_socket = client_socket;
         strncpy(info->folder_path, "/home/sana-hashim/Desktop/bscs22101_bscs22017_Group_D_OS-main", FILE_PATH_BUFFER_SIZE);
 
@@ -0,0 +1,261 @@
+#ifndef URING_H
+#define URING_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+// Minimal io_uring ring on the raw syscalls, enough for batched file and
+// socket transfers without depending on liburing. A ring owns a set of
+// page-aligned transfer buffers registered with the kernel (used by
+// READ_FIXED/WRITE_FIXED) and a sparse table of registered files that
+// callers fill per transfer with uring_set_files.
+//
+// A ring is not thread safe; give each thread its own.
+
+#define URING_ENTRIES 16          // Submission queue size
+#define URING_BUFFERS 4           // Registered transfer buffers per ring
+#define URING_BUFFER_SIZE 65536   // Size of each transfer buffer
+#define URING_FILES 2             // Registered file slots
+
+typedef struct {
+    int fd;
+    // Submission queue
+    _Atomic unsigned *sq_head;
+    _Atomic unsigned *sq_tail;
+    unsigned sq_mask;
+    unsigned *sq_array;
+    struct io_uring_sqe *sqes;
+    unsigned sq_local_tail;      // Next SQE to hand out
+    // Completion queue
+    _Atomic unsigned *cq_head;
+    _Atomic unsigned *cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe *cqes;
+    // Mappings
+    void *sq_ring;
+    size_t sq_ring_size;
+    void *cq_ring;
+    size_t cq_ring_size;
+    size_t sqes_size;
+    char *buffers;               // URING_BUFFERS * URING_BUFFER_SIZE bytes
+} Uring;
+
+// Function prototypes
+int uring_init(Uring *ring);
+void uring_destroy(Uring *ring);
+int uring_set_files(Uring *ring, const int *fds, unsigned count);
+void uring_release_files(Uring *ring);
+struct io_uring_sqe *uring_get_sqe(Uring *ring);
+int uring_submit_and_wait(Uring *ring, unsigned wait_nr);
+struct io_uring_cqe *uring_peek_cqe(Uring *ring);
+struct io_uring_cqe *uring_wait_cqe(Uring *ring);
+void uring_cqe_seen(Uring *ring);
+char *uring_buffer(Uring *ring, unsigned index);
+
+
+static int uring_setup(unsigned entries, struct io_uring_params *params) {
+    return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int uring_register(int fd, unsigned opcode, void *arg, unsigned nr_args) {
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+// Returns 0 on success, -1 if io_uring is unavailable or setup failed
+int uring_init(Uring *ring) {
+    struct io_uring_params params;
+
+    memset(ring, 0, sizeof(Uring));
+    memset(&params, 0, sizeof(params));
+    ring->fd = uring_setup(URING_ENTRIES, &params);
+    if (ring->fd < 0) {
+        ring->fd = -1;
+        return -1; // ENOSYS on old kernels, EPERM when disabled by policy
+    }
+
+    ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        // Both rings live in one mapping
+        if (ring->cq_ring_size > ring->sq_ring_size) {
+            ring->sq_ring_size = ring->cq_ring_size;
+        }
+        ring->cq_ring_size = ring->sq_ring_size;
+    }
+
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (ring->sq_ring == MAP_FAILED) {
+        ring->sq_ring = NULL;
+        goto fail;
+    }
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->cq_ring = ring->sq_ring;
+    } else {
+        ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+        if (ring->cq_ring == MAP_FAILED) {
+            ring->cq_ring = NULL;
+            goto fail;
+        }
+    }
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        ring->sqes = NULL;
+        goto fail;
+    }
+
+    char *sq = (char *)ring->sq_ring;
+    char *cq = (char *)ring->cq_ring;
+    ring->sq_head = (_Atomic unsigned *)(sq + params.sq_off.head);
+    ring->sq_tail = (_Atomic unsigned *)(sq + params.sq_off.tail);
+    ring->sq_mask = *(unsigned *)(sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned *)(sq + params.sq_off.array);
+    ring->cq_head = (_Atomic unsigned *)(cq + params.cq_off.head);
+    ring->cq_tail = (_Atomic unsigned *)(cq + params.cq_off.tail);
+    ring->cq_mask = *(unsigned *)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+    ring->sq_local_tail = atomic_load_explicit(ring->sq_tail, memory_order_relaxed);
+
+    // Transfer buffers are pinned by the kernel once registered
+    ring->buffers = mmap(NULL, (size_t)URING_BUFFERS * URING_BUFFER_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ring->buffers == MAP_FAILED) {
+        ring->buffers = NULL;
+        goto fail;
+    }
+    struct iovec iov[URING_BUFFERS];
+    for (unsigned i = 0; i < URING_BUFFERS; i++) {
+        iov[i].iov_base = uring_buffer(ring, i);
+        iov[i].iov_len = URING_BUFFER_SIZE;
+    }
+    if (uring_register(ring->fd, IORING_REGISTER_BUFFERS, iov, URING_BUFFERS) != 0) {
+        goto fail;
+    }
+
+    // Empty file table, filled per transfer
+    int fds[URING_FILES];
+    for (unsigned i = 0; i < URING_FILES; i++) {
+        fds[i] = -1;
+    }
+    if (uring_register(ring->fd, IORING_REGISTER_FILES, fds, URING_FILES) != 0) {
+        goto fail;
+    }
+    return 0;
+
+fail:
+    uring_destroy(ring);
+    return -1;
+}
+
+void uring_destroy(Uring *ring) {
+    if (ring->buffers) {
+        munmap(ring->buffers, (size_t)URING_BUFFERS * URING_BUFFER_SIZE);
+    }
+    if (ring->sqes) {
+        munmap(ring->sqes, ring->sqes_size);
+    }
+    if (ring->cq_ring && ring->cq_ring != ring->sq_ring) {
+        munmap(ring->cq_ring, ring->cq_ring_size);
+    }
+    if (ring->sq_ring) {
+        munmap(ring->sq_ring, ring->sq_ring_size);
+    }
+    if (ring->fd >= 0) {
+        close(ring->fd); // Also drops the registered buffers and files
+    }
+    memset(ring, 0, sizeof(Uring));
+    ring->fd = -1;
+}
+
+// Point the registered file slots at fds (one update syscall per transfer)
+int uring_set_files(Uring *ring, const int *fds, unsigned count) {
+    struct io_uring_files_update update;
+
+    memset(&update, 0, sizeof(update));
+    update.offset = 0;
+    update.fds = (unsigned long)fds;
+    return uring_register(ring->fd, IORING_REGISTER_FILES_UPDATE, &update, count) == (int)count ? 0 : -1;
+}
+
+// Empty the file slots again. Registered files hold a reference, so a socket
+// left in a slot would not really close until the next transfer replaced it.
+void uring_release_files(Uring *ring) {
+    int fds[URING_FILES];
+    for (unsigned i = 0; i < URING_FILES; i++) {
+        fds[i] = -1;
+    }
+    uring_set_files(ring, fds, URING_FILES);
+}
+
+char *uring_buffer(Uring *ring, unsigned index) {
+    return ring->buffers + (size_t)index * URING_BUFFER_SIZE;
+}
+
+// Next free submission entry, zeroed, or NULL if the queue is full
+struct io_uring_sqe *uring_get_sqe(Uring *ring) {
+    unsigned head = atomic_load_explicit(ring->sq_head, memory_order_acquire);
+    if (ring->sq_local_tail - head > ring->sq_mask) {
+        return NULL;
+    }
+    unsigned index = ring->sq_local_tail & ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+    ring->sq_array[index] = index;
+    ring->sq_local_tail++;
+    memset(sqe, 0, sizeof(*sqe));
+    return sqe;
+}
+
+// Publish every prepared entry and wait for at least wait_nr completions in
+// a single syscall. Returns the number submitted, or -1 on error.
+int uring_submit_and_wait(Uring *ring, unsigned wait_nr) {
+    atomic_store_explicit(ring->sq_tail, ring->sq_local_tail, memory_order_release);
+    while (1) {
+        // Entries the kernel has not consumed yet, including any left by an
+        // interrupted call
+        unsigned to_submit = ring->sq_local_tail - atomic_load_explicit(ring->sq_head, memory_order_acquire);
+        int submitted = uring_enter(ring->fd, to_submit, wait_nr, wait_nr ? IORING_ENTER_GETEVENTS : 0);
+        if (submitted >= 0) {
+            return submitted;
+        }
+        if (errno != EINTR) {
+            return -1;
+        }
+    }
+}
+
+// Oldest completion, waiting for one if none is ready. NULL on error.
+struct io_uring_cqe *uring_wait_cqe(Uring *ring) {
+    struct io_uring_cqe *cqe;
+
+    while ((cqe = uring_peek_cqe(ring)) == NULL) {
+        if (uring_submit_and_wait(ring, 1) < 0) {
+            return NULL;
+        }
+    }
+    return cqe;
+}
+
+// Oldest unconsumed completion, or NULL if none is ready
+struct io_uring_cqe *uring_peek_cqe(Uring *ring) {
+    unsigned head = atomic_load_explicit(ring->cq_head, memory_order_relaxed);
+    unsigned tail = atomic_load_explicit(ring->cq_tail, memory_order_acquire);
+    return head == tail ? NULL : &ring->cqes[head & ring->cq_mask];
+}
+
+void uring_cqe_seen(Uring *ring) {
+    unsigned head = atomic_load_explicit(ring->cq_head, memory_order_relaxed);
+    atomic_store_explicit(ring->cq_head, head + 1, memory_order_release);
+}
+
+#endif // URING_H